@@ -1,4 +1,5 @@
 #include <iostream>
+#include <iomanip>
 #include <map>
 #include <vector>
 #include <mutex>
@@ -10,8 +11,28 @@
 #include <chrono>
 #include <queue>
 #include <condition_variable>
+#include <future>
 #include <algorithm>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <set>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <sched.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -19,228 +40,4444 @@ class FinancialTransactionSystem {
 public:
     class Transaction;
 
+    enum class IsolationLevel {
+        Serializable,          // validate every read at commit
+        SnapshotIsolation,     // first-committer-wins on write-write conflicts only
+        SerializableSnapshot   // snapshot isolation plus rw-antidependency tracking
+    };
+
+    enum class ConflictResolution {
+        FirstCommitterWins,   // whichever transaction validates first survives
+        PriorityWound         // higher priority claims its write set; lower-priority writers abort and retry
+    };
+
+    struct StaleBalance {
+        double balance;
+        unsigned asOfTimestamp;
+        chrono::steady_clock::time_point asOf;
+    };
+
+    enum class BulkFormat {
+        Csv,     // "accountId,balance" per line; non-numeric lines such as headers are skipped
+        Binary   // packed BinaryAccountRecord entries
+    };
+
+    struct BinaryAccountRecord {
+        uint32_t accountId;
+        uint32_t reserved;
+        double balance;
+    };
+
+    struct BulkLoadStats {
+        size_t rows;
+        double seconds;
+        double rowsPerSecond;
+    };
+
+    enum class ReportKind {
+        Balances,   // "accountId,balance"
+        Histories   // "accountId,timestamp,balance" for every version
+    };
+
+    struct ReportStats {
+        size_t accounts;
+        size_t bytes;
+        unsigned asOfTimestamp;
+        double seconds;
+    };
+
+    // Balances are digested in cents so that sums and hashes do not depend on the
+    // order in which accounts are visited.
+    struct ReconciliationDigest {
+        uint64_t accounts;
+        long long balanceCents;
+        uint64_t hash;
+
+        bool operator==(const ReconciliationDigest& other) const {
+            return accounts == other.accounts && balanceCents == other.balanceCents && hash == other.hash;
+        }
+        bool operator!=(const ReconciliationDigest& other) const { return !(*this == other); }
+    };
+
+    // Complete binary tree over fixed account ID ranges of 2^leafBits IDs each.
+    // nodes[1] is the root, node i has children 2i and 2i + 1, and leaf k is
+    // nodes[leafCount + k].
+    struct ReconciliationTree {
+        unsigned asOfTimestamp;
+        unsigned leafBits;
+        vector<ReconciliationDigest> nodes;
+        double seconds;
+
+        const ReconciliationDigest& total() const { return nodes[1]; }
+    };
+
+    static constexpr unsigned kAnyInstrument = numeric_limits<unsigned>::max();
+
+    // A holder's position in instrument k > 0 lives in account holder + k * stride,
+    // following the wallet convention of executeCryptoTrade; instrument 0 is cash.
+    static constexpr unsigned kInstrumentAccountStride = 1000000;
+
+    static unsigned positionAccount(unsigned holderAccountId, unsigned instrument) {
+        return holderAccountId + instrument * kInstrumentAccountStride;
+    }
+
+    // Applied to every holder of instrument: the position is multiplied by
+    // positionFactor (2.0 for a 2-for-1 split) and position * cashPerUnit is
+    // credited to the holder's cash account (a dividend).
+    struct CorporateAction {
+        unsigned instrument;
+        double positionFactor;
+        double cashPerUnit;
+    };
+
+    struct CorporateActionStats {
+        size_t holders;
+        unsigned effectiveTimestamp;
+        double seconds;
+    };
+
+    // Exposure of a row's account to counterparty: gross is the notional traded in
+    // both directions, net the notional sold to counterparty minus that bought
+    // from it.
+    struct CounterpartyExposure {
+        unsigned counterparty;
+        double gross;
+        double net;
+    };
+
+    struct ExposureAlert {
+        unsigned accountId;
+        CounterpartyExposure exposure;
+    };
+
+    enum class LegConstraint : uint8_t {
+        None,
+        NonNegative   // the account's balance after the transaction is at least 0
+    };
+
+    struct Quote {
+        double bid;
+        double bidSize;
+        double ask;
+        double askSize;
+    };
+
+    static constexpr unsigned kMaxQuotedInstruments = 4096;
+
+    enum class BookSide : uint8_t { Bid, Ask };
+
+    enum class MarketDataType : uint8_t {
+        LevelUpdate,     // size is the level's new total; 0 removes the level
+        Trade,           // size is the traded quantity
+        SnapshotStart,   // size is the number of SnapshotLevel messages that follow
+        SnapshotLevel,
+        SnapshotEnd
+    };
+
+    // One 32-byte feed record. Sequences start at 1 and have no gaps.
+    struct MarketDataMessage {
+        uint64_t sequence;
+        uint32_t instrument;
+        MarketDataType type;
+        BookSide side;
+        uint16_t reserved;
+        double price;
+        double size;
+    };
+    static_assert(sizeof(MarketDataMessage) == 32, "Market data messages are 32 bytes");
+
+    struct MarketDataHeader {
+        static constexpr uint64_t kMagic = 0x314454414D4B4DULL;
+
+        uint64_t magic;
+        uint64_t capacity;              // slots after the header
+        atomic<uint64_t> published;     // sequence of the newest complete message
+        char padding[40];
+    };
+    static_assert(sizeof(MarketDataHeader) == 64, "Market data header is one cache line");
+
+    // A message as four words; word 0 is the sequence, stored last with release
+    // and cleared first, so a reader can tell a complete slot from one in flux.
+    struct MarketDataSlot {
+        atomic<uint64_t> words[4];
+
+        void write(const MarketDataMessage& message) {
+            uint64_t encoded[4];
+            memcpy(encoded, &message, sizeof(encoded));
+            words[0].store(0, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            for (size_t i = 1; i < 4; ++i) {
+                words[i].store(encoded[i], memory_order_relaxed);
+            }
+            words[0].store(encoded[0], memory_order_release);
+        }
+
+        bool read(uint64_t sequence, MarketDataMessage& message) const {
+            uint64_t encoded[4];
+            encoded[0] = words[0].load(memory_order_acquire);
+            if (encoded[0] != sequence) return false;
+            for (size_t i = 1; i < 4; ++i) {
+                encoded[i] = words[i].load(memory_order_relaxed);
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (words[0].load(memory_order_relaxed) != sequence) return false;
+            memcpy(&message, encoded, sizeof(encoded));
+            return true;
+        }
+    };
+    static_assert(sizeof(MarketDataSlot) == sizeof(MarketDataMessage), "Slots hold one message");
+
+    struct AuctionOrder {
+        unsigned account;
+        BookSide side;
+        double limitPrice;
+        double quantity;
+    };
+
+    struct AuctionFill {
+        size_t orderIndex;
+        double quantity;
+    };
+
+    struct AuctionResult {
+        double price;        // 0 when no orders cross
+        double volume;       // 0, with no fills, when settlement failed
+        vector<AuctionFill> fills;
+        vector<size_t> rejectedOrders;   // indexes of orders dropped as unfunded
+        bool settled;
+        double seconds;
+    };
+
+    static constexpr size_t kMaxAuctionLadder = size_t{1} << 22;
+
+    // An inbound trade as journalled by the order flow ring, 32 bytes per record.
+    struct OrderFlowRecord {
+        uint64_t sequence;
+        uint32_t buyerAccountId;
+        uint32_t sellerAccountId;
+        uint32_t instrument;
+        uint32_t reserved;
+        double amount;
+    };
+    static_assert(sizeof(OrderFlowRecord) == 32, "Order flow records are 32 bytes");
+
+    // Log-linear latency histogram in the style of HdrHistogram: exact below 256 ns,
+    // then 128 buckets per power of two, so any recorded value is reported within
+    // 1%. Recording is one relaxed atomic increment and safe from any thread.
+    class LatencyHistogram {
+    public:
+        static constexpr unsigned kSubBucketBits = 8;
+        static constexpr size_t kHalfSubBuckets = size_t{1} << (kSubBucketBits - 1);
+        static constexpr size_t kBuckets = (64 - kSubBucketBits + 2) * kHalfSubBuckets;
+
+        LatencyHistogram() : counts(new atomic<uint64_t>[kBuckets]) {
+            for (size_t i = 0; i < kBuckets; ++i) {
+                counts[i].store(0, memory_order_relaxed);
+            }
+        }
+
+        void record(uint64_t nanoseconds) {
+            counts[bucketFor(nanoseconds)].fetch_add(1, memory_order_relaxed);
+            total.fetch_add(1, memory_order_relaxed);
+            uint64_t seen = largest.load(memory_order_relaxed);
+            while (nanoseconds > seen && !largest.compare_exchange_weak(seen, nanoseconds, memory_order_relaxed)) {
+            }
+        }
+
+        void merge(const LatencyHistogram& other) {
+            for (size_t i = 0; i < kBuckets; ++i) {
+                counts[i].fetch_add(other.counts[i].load(memory_order_relaxed), memory_order_relaxed);
+            }
+            total.fetch_add(other.count(), memory_order_relaxed);
+            uint64_t otherLargest = other.max();
+            uint64_t seen = largest.load(memory_order_relaxed);
+            while (otherLargest > seen && !largest.compare_exchange_weak(seen, otherLargest, memory_order_relaxed)) {
+            }
+        }
+
+        uint64_t count() const { return total.load(memory_order_relaxed); }
+        uint64_t max() const { return largest.load(memory_order_relaxed); }
+
+        // Smallest recorded value, to histogram precision, that percentile percent
+        // of the recordings do not exceed.
+        uint64_t valueAtPercentile(double percentile) const {
+            uint64_t recorded = count();
+            if (recorded == 0) return 0;
+            double clamped = min(100.0, std::max(0.0, percentile));
+            uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(ceil(clamped / 100.0 * recorded)));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < kBuckets; ++i) {
+                seen += counts[i].load(memory_order_relaxed);
+                if (seen >= rank) return min(highestValueIn(i), max());
+            }
+            return max();
+        }
+
+    private:
+        unique_ptr<atomic<uint64_t>[]> counts;
+        atomic<uint64_t> total{0};
+        atomic<uint64_t> largest{0};
+
+        static size_t bucketFor(uint64_t value) {
+            if (value < (uint64_t{1} << kSubBucketBits)) return static_cast<size_t>(value);
+            unsigned shift = static_cast<unsigned>(63 - __builtin_clzll(value)) - (kSubBucketBits - 1);
+            return shift * kHalfSubBuckets + static_cast<size_t>(value >> shift);
+        }
+
+        static uint64_t highestValueIn(size_t bucket) {
+            if (bucket < (size_t{1} << kSubBucketBits)) return bucket;
+            unsigned shift = static_cast<unsigned>(bucket / kHalfSubBuckets - 1);
+            uint64_t lowest = static_cast<uint64_t>(bucket - shift * kHalfSubBuckets) << shift;
+            return lowest + ((uint64_t{1} << shift) - 1);
+        }
+    };
+
+    // Latency runs from each submission's intended send time on the fixed
+    // schedule to its completion, so time spent waiting behind a stalled system
+    // is counted rather than omitted.
+    struct OpenLoopResult {
+        double targetRate;      // submissions per second
+        double achievedRate;    // completions per second over the run
+        size_t completed;
+        size_t failed;          // rejected at submission, given up, dropped or cancelled
+        shared_ptr<LatencyHistogram> latency;
+    };
+
+    struct OrderFlowStats {
+        uint64_t published;
+        uint64_t journaled;
+        uint64_t settled;          // includes rejected and failed orders
+        size_t rejectedByRisk;
+        size_t failed;             // insufficient funds or unknown accounts
+    };
+
+    // Follows a feed written by enableMarketDataFeed, possibly in another process,
+    // starting after its newest message. A reader that falls a whole ring behind
+    // skips to the oldest retained message and counts a gap; it should then drop
+    // its books and rebuild each from that instrument's next snapshot.
+    class MarketDataSubscriber {
+    public:
+        explicit MarketDataSubscriber(const string& path) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw runtime_error("Cannot open " + path);
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(MarketDataHeader)) {
+                close(fd);
+                throw runtime_error("Not a market data feed: " + path);
+            }
+            length = static_cast<size_t>(info.st_size);
+            void* mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED) {
+                throw runtime_error("Cannot map " + path);
+            }
+            header = static_cast<const MarketDataHeader*>(mapping);
+            if (header->magic != MarketDataHeader::kMagic ||
+                length != sizeof(MarketDataHeader) + header->capacity * sizeof(MarketDataSlot)) {
+                munmap(mapping, length);
+                throw runtime_error("Not a market data feed: " + path);
+            }
+            slots = reinterpret_cast<const MarketDataSlot*>(header + 1);
+            next = header->published.load(memory_order_acquire) + 1;
+        }
+
+        ~MarketDataSubscriber() {
+            munmap(const_cast<MarketDataHeader*>(header), length);
+        }
+
+        MarketDataSubscriber(const MarketDataSubscriber&) = delete;
+        MarketDataSubscriber& operator=(const MarketDataSubscriber&) = delete;
+
+        // Returns false when no new message has been published.
+        bool poll(MarketDataMessage& message) {
+            while (true) {
+                uint64_t published = header->published.load(memory_order_acquire);
+                if (next > published) return false;
+                if (published - next >= header->capacity) {
+                    next = published - header->capacity + 1;
+                    ++gaps;
+                }
+                if (slots[(next - 1) % header->capacity].read(next, message)) {
+                    ++next;
+                    return true;
+                }
+                // Overwritten while copying, so this reader fell a whole ring behind.
+            }
+        }
+
+        uint64_t gapCount() const { return gaps; }
+
+    private:
+        const MarketDataHeader* header = nullptr;
+        const MarketDataSlot* slots = nullptr;
+        size_t length = 0;
+        uint64_t next = 0;
+        uint64_t gaps = 0;
+    };
+
+    // Adds amount to holder account's balance in asset, i.e. to
+    // positionAccount(account, asset); asset 0 is cash.
+    struct Leg {
+        unsigned account;
+        unsigned asset;
+        double amount;
+        LegConstraint constraint;
+    };
+
+    // A rule applies to accounts of its tier trading its instrument, or any
+    // instrument, with a notional of at least minNotional. For each combination the
+    // rule with an exact instrument wins, then the one with the highest
+    // minNotional, then the later one.
+    struct FeeRule {
+        unsigned tier;
+        unsigned instrument;
+        double minNotional;
+        double basisPoints;
+        double flatFee;
+    };
+
+    struct FeeSchedule {
+        static constexpr unsigned kMaxTiers = 16;
+        static constexpr unsigned kMaxBrackets = 8;
+
+        unsigned feeAccountId = 0;
+        vector<FeeRule> rules;
+        unordered_map<unsigned, unsigned> accountTiers;   // unlisted accounts are tier 0
+    };
+
+    enum class MemorySubsystem : unsigned {
+        VersionChains,
+        AccountIndex,
+        ColdIndex,
+        TransactionQueue,
+        ReadWriteSets,
+        Snapshots,
+        Count
+    };
+
+    // A default-constructed token can never be cancelled; use create() for a live one.
+    class CancellationToken {
+    public:
+        CancellationToken() = default;
+
+        static CancellationToken create() {
+            CancellationToken token;
+            token.state = make_shared<atomic<bool>>(false);
+            return token;
+        }
+
+        void cancel() const {
+            if (state) state->store(true);
+        }
+
+        bool isCancelled() const {
+            return state && state->load(memory_order_relaxed);
+        }
+
+    private:
+        shared_ptr<atomic<bool>> state;
+    };
+
+    struct TransactionOptions {
+        static constexpr unsigned kMaxDeclaredAccounts = 4;
+
+        chrono::steady_clock::time_point deadline;
+        CancellationToken cancellation;
+        unsigned clientId;          // 0 submits without client rate limiting
+        unsigned schedulingClass;   // fair-queuing class, e.g. a tenant or transaction type
+        // Accounts the logic is expected to touch. Only used as prefetch hints by
+        // workers; declaring none, or the wrong ones, never affects correctness.
+        unsigned declaredAccounts[kMaxDeclaredAccounts];
+        unsigned declaredAccountCount;
+        // Called on the worker thread once the transaction commits (true) or is
+        // given up, dropped or cancelled (false).
+        function<void(bool)> onComplete;
+
+        TransactionOptions()
+            : deadline(chrono::steady_clock::time_point::max()), clientId(0), schedulingClass(0),
+              declaredAccounts(), declaredAccountCount(0) {}
+
+        // Declarations beyond kMaxDeclaredAccounts are ignored.
+        TransactionOptions& declareAccount(unsigned accountId) {
+            if (declaredAccountCount < kMaxDeclaredAccounts) {
+                declaredAccounts[declaredAccountCount++] = accountId;
+            }
+            return *this;
+        }
+
+        static TransactionOptions withTimeout(chrono::steady_clock::duration timeout,
+                                              CancellationToken token = CancellationToken()) {
+            TransactionOptions options;
+            options.deadline = chrono::steady_clock::now() + timeout;
+            options.cancellation = move(token);
+            return options;
+        }
+    };
+
 private:
+    // Fixed-capacity open-addressing table of token buckets. Slots are claimed with
+    // a CAS on clientId; each bucket packs the last refill time in milliseconds and
+    // the available millitokens into one word updated by CAS. Lookups probe at most
+    // kMaxProbe slots. A slot whose client has no explicit limit and has been idle
+    // with a full bucket for kIdleMillis is handed to the next client that needs
+    // one. A default-limited client that still finds no slot shares one overflow
+    // bucket, so it is neither untracked nor refused for good.
+    class ClientRateLimiter {
+    public:
+        static constexpr unsigned kSlotBits = 13;
+        static constexpr size_t kSlots = size_t{1} << kSlotBits;
+        static constexpr size_t kMaxProbe = 64;
+        static constexpr uint32_t kIdleMillis = 60000;
+        static constexpr uint32_t kMaxBurst = numeric_limits<uint32_t>::max() / 1000;
+
+        void setDefault(uint32_t ratePerSecond, uint32_t burst) {
+            defaultLimits.store(packLimits(ratePerSecond, min(burst, kMaxBurst)));
+        }
+
+        bool configure(unsigned clientId, uint32_t ratePerSecond, uint32_t burst) {
+            Bucket* bucket = findOrClaim(clientId);
+            if (bucket == nullptr) return false;
+            burst = min(burst, kMaxBurst);
+            bucket->configured.store(true);
+            bucket->limits.store(packLimits(ratePerSecond, burst));
+            bucket->state.store(static_cast<uint64_t>(nowMillis()) << 32 | uint64_t{burst} * 1000);
+            return true;
+        }
+
+        bool tryAcquire(unsigned clientId, uint64_t tokens) {
+            Bucket* bucket = find(clientId);
+            if (bucket == nullptr) {
+                if (defaultLimits.load() == 0) return true;
+                bucket = findOrClaim(clientId);
+                if (bucket == nullptr) bucket = &overflow;
+            }
+            uint64_t limits = bucket->limits.load(memory_order_acquire);
+            if (limits == 0) {
+                // Newly claimed or reclaimed: start full under the default limit.
+                uint64_t defaults = defaultLimits.load();
+                if (defaults == 0) return true;
+                // The state is set before the limits that make other threads use it.
+                uint64_t unset = 0;
+                bucket->state.compare_exchange_strong(
+                    unset, static_cast<uint64_t>(nowMillis()) << 32 | (defaults & 0xFFFFFFFFu) * 1000);
+                unset = 0;
+                bucket->limits.compare_exchange_strong(unset, defaults);
+                limits = bucket->limits.load(memory_order_acquire);
+            }
+            uint64_t rate = limits >> 32;
+            uint64_t capacity = (limits & 0xFFFFFFFFu) * 1000;
+            uint64_t cost = tokens * 1000;
+
+            uint32_t now = nowMillis();
+            uint64_t state = bucket->state.load(memory_order_relaxed);
+            while (true) {
+                uint32_t last = static_cast<uint32_t>(state >> 32);
+                uint32_t elapsed = now - last;
+                uint32_t stamp = now;
+                // A stamp slightly ahead of now was stored by another thread; one
+                // far ahead is a refill time from before the clock wrapped.
+                if (elapsed > 0x80000000u && last - now < 60000u) {
+                    elapsed = 0;
+                    stamp = last;
+                }
+                uint64_t available = min(capacity, (state & 0xFFFFFFFFu) + min(elapsed, 60000u) * rate);
+                if (available < cost) return false;
+                uint64_t next = static_cast<uint64_t>(stamp) << 32 | (available - cost);
+                if (bucket->state.compare_exchange_weak(state, next, memory_order_relaxed)) return true;
+            }
+        }
+
+    private:
+        struct alignas(64) Bucket {
+            atomic<uint32_t> clientId{0};
+            atomic<bool> configured{false};   // has an explicit limit; never reclaimed
+            atomic<uint64_t> limits{0};
+            atomic<uint64_t> state{0};
+        };
+
+        unique_ptr<Bucket[]> buckets{new Bucket[kSlots]};
+        Bucket overflow;
+        atomic<uint64_t> defaultLimits{0};
+
+        static uint64_t packLimits(uint32_t ratePerSecond, uint32_t burst) {
+            return static_cast<uint64_t>(ratePerSecond) << 32 | burst;
+        }
+
+        static uint32_t nowMillis() {
+            return static_cast<uint32_t>(chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        // Fibonacci hashing keeps the product's high bits, which depend on every bit
+        // of clientId, so IDs sharing their low bits still spread across the table.
+        static size_t slotFor(unsigned clientId) {
+            return static_cast<size_t>((uint64_t{clientId} * 0x9E3779B97F4A7C15ull) >> (64 - kSlotBits));
+        }
+
+        // True when the bucket has no explicit limit, has not been charged for
+        // kIdleMillis and has refilled to capacity, so its client loses nothing if
+        // it is given a fresh bucket later.
+        static bool reclaimable(const Bucket& bucket, uint32_t now) {
+            if (bucket.configured.load(memory_order_relaxed)) return false;
+            uint64_t limits = bucket.limits.load(memory_order_relaxed);
+            if (limits == 0) return false;  // Still being set up by its claimant
+            uint64_t state = bucket.state.load(memory_order_relaxed);
+            uint32_t last = static_cast<uint32_t>(state >> 32);
+            uint32_t elapsed = now - last;
+            if (elapsed < kIdleMillis || (elapsed > 0x80000000u && last - now < 60000u)) return false;
+            uint64_t capacity = (limits & 0xFFFFFFFFu) * 1000;
+            return (state & 0xFFFFFFFFu) + uint64_t{min(elapsed, 60000u)} * (limits >> 32) >= capacity;
+        }
+
+        Bucket* find(unsigned clientId) {
+            for (size_t probe = 0, index = slotFor(clientId); probe < kMaxProbe; ++probe, index = (index + 1) & (kSlots - 1)) {
+                uint32_t owner = buckets[index].clientId.load(memory_order_acquire);
+                if (owner == clientId) return &buckets[index];
+                if (owner == 0) return nullptr;
+            }
+            return nullptr;
+        }
+
+        // Slots are never emptied, only handed over, so probe chains stay intact. A
+        // request racing a handover may be charged to the slot's new client.
+        Bucket* findOrClaim(unsigned clientId) {
+            uint32_t now = nowMillis();
+            Bucket* idle = nullptr;
+            uint32_t idleOwner = 0;
+            for (size_t probe = 0, index = slotFor(clientId); probe < kMaxProbe; ++probe, index = (index + 1) & (kSlots - 1)) {
+                uint32_t owner = buckets[index].clientId.load(memory_order_acquire);
+                if (owner == 0 && idle == nullptr && buckets[index].clientId.compare_exchange_strong(owner, clientId)) {
+                    return &buckets[index];
+                }
+                if (owner == clientId) return &buckets[index];
+                if (owner == 0) break;
+                if (idle == nullptr && reclaimable(buckets[index], now)) {
+                    idle = &buckets[index];
+                    idleOwner = owner;
+                }
+            }
+            if (idle == nullptr || !idle->clientId.compare_exchange_strong(idleOwner, clientId)) {
+                return nullptr;
+            }
+            idle->configured.store(false);
+            idle->state.store(0);
+            idle->limits.store(0);
+            return idle;
+        }
+    };
+
     struct TransactionInfo {
         function<void(Transaction&)> logic;
+        function<void(bool)> onComplete;
         int priority;
         string description;
         chrono::steady_clock::time_point startTime;
+        chrono::steady_clock::time_point deadline;
+        CancellationToken cancellation;
+        unsigned schedulingClass;
+        unsigned declaredAccounts[TransactionOptions::kMaxDeclaredAccounts];
+        unsigned declaredAccountCount;
+
+        TransactionInfo(function<void(Transaction&)> l, int p, string desc,
+                        const TransactionOptions& options = TransactionOptions())
+            : logic(move(l)), onComplete(options.onComplete), priority(p), description(move(desc)),
+              startTime(chrono::steady_clock::now()),
+              deadline(options.deadline), cancellation(options.cancellation),
+              schedulingClass(options.schedulingClass), declaredAccountCount(options.declaredAccountCount) {
+            copy(begin(options.declaredAccounts), end(options.declaredAccounts), begin(declaredAccounts));
+        }
+
+        bool expired(chrono::steady_clock::time_point now) const {
+            return now >= deadline || cancellation.isCancelled();
+        }
+    };
+
+    struct CompareTransactionInfo {
+        bool operator()(const TransactionInfo& lhs, const TransactionInfo& rhs) {
+            if (lhs.priority != rhs.priority) {
+                return lhs.priority < rhs.priority;
+            }
+            return lhs.startTime > rhs.startTime;
+        }
+    };
+
+    // Deficit round robin across scheduling classes with unit cost per dispatch, so
+    // every backlogged class receives at least weight / (sum of backlogged weights)
+    // of dispatches. Within a class, entries keep strict priority order.
+    class FairTransactionQueue {
+    public:
+        template <typename... Args>
+        void emplace(Args&&... args) {
+            TransactionInfo info(forward<Args>(args)...);
+            unsigned classId = info.schedulingClass;
+            ClassQueue& queue = classes[classId];
+            if (queue.entries.empty()) {
+                queue.deficit = weightOf(classId);
+                activeClasses.push_back(classId);
+            }
+            queue.entries.push(move(info));
+            ++count;
+        }
+
+        bool empty() const { return count == 0; }
+        size_t size() const { return count; }
+
+        const TransactionInfo& top() {
+            return current().entries.top();
+        }
+
+        void pop() {
+            ClassQueue& queue = current();
+            queue.entries.pop();
+            --queue.deficit;
+            --count;
+            if (queue.entries.empty()) {
+                queue.deficit = 0;
+                activeClasses.pop_front();
+            }
+        }
+
+        void setWeight(unsigned classId, unsigned weight) {
+            weights[classId] = max(1u, weight);
+        }
+
+    private:
+        struct ClassQueue {
+            priority_queue<TransactionInfo, vector<TransactionInfo>, CompareTransactionInfo> entries;
+            long long deficit = 0;
+        };
+
+        unordered_map<unsigned, ClassQueue> classes;
+        unordered_map<unsigned, unsigned> weights;
+        deque<unsigned> activeClasses;
+        size_t count = 0;
+
+        unsigned weightOf(unsigned classId) const {
+            auto it = weights.find(classId);
+            return it == weights.end() ? 1 : it->second;
+        }
+
+        ClassQueue& current() {
+            while (true) {
+                unsigned classId = activeClasses.front();
+                ClassQueue& queue = classes[classId];
+                if (queue.deficit > 0) return queue;
+                activeClasses.pop_front();
+                activeClasses.push_back(classId);
+                queue.deficit += weightOf(classId);
+            }
+        }
+    };
+
+    // Byte counters per subsystem for one engine, striped by CPU so that allocation
+    // paths only touch a local cache line. Reads sum the stripes.
+    class MemoryAccounting {
+    public:
+        static constexpr size_t kStripes = 64;
+        static constexpr size_t kSubsystems = static_cast<size_t>(MemorySubsystem::Count);
+
+        void add(MemorySubsystem subsystem, long long bytes) {
+            int cpu = sched_getcpu();
+            size_t stripe = cpu < 0 ? 0 : static_cast<size_t>(cpu) % kStripes;
+            stripes[stripe].bytes[static_cast<size_t>(subsystem)].fetch_add(bytes, memory_order_relaxed);
+        }
+
+        size_t usage(MemorySubsystem subsystem) const {
+            long long total = 0;
+            for (const auto& stripe : stripes) {
+                total += stripe.bytes[static_cast<size_t>(subsystem)].load(memory_order_relaxed);
+            }
+            return total > 0 ? static_cast<size_t>(total) : 0;
+        }
+
+    private:
+        struct alignas(64) Stripe {
+            atomic<long long> bytes[kSubsystems];
+        };
+        Stripe stripes[kStripes] = {};
+    };
+
+    // Declared before every container that charges it. Mutable so that const
+    // paths which build temporary records can still charge their blocks.
+    mutable MemoryAccounting memoryAccounting;
+
+    template <typename T, MemorySubsystem Subsystem>
+    struct TrackingAllocator {
+        using value_type = T;
+
+        template <typename U>
+        struct rebind {
+            using other = TrackingAllocator<U, Subsystem>;
+        };
+
+        using propagate_on_container_copy_assignment = true_type;
+        using propagate_on_container_move_assignment = true_type;
+        using propagate_on_container_swap = true_type;
+
+        MemoryAccounting* accounting;
+
+        explicit TrackingAllocator(MemoryAccounting& owner) noexcept : accounting(&owner) {}
+        template <typename U>
+        TrackingAllocator(const TrackingAllocator<U, Subsystem>& other) noexcept : accounting(other.accounting) {}
+
+        T* allocate(size_t n) {
+            T* memory = allocator<T>().allocate(n);
+            accounting->add(Subsystem, static_cast<long long>(n * sizeof(T)));
+            return memory;
+        }
+
+        void deallocate(T* memory, size_t n) noexcept {
+            accounting->add(Subsystem, -static_cast<long long>(n * sizeof(T)));
+            allocator<T>().deallocate(memory, n);
+        }
+
+        template <typename U>
+        bool operator==(const TrackingAllocator<U, Subsystem>& other) const noexcept {
+            return accounting == other.accounting;
+        }
+        template <typename U>
+        bool operator!=(const TrackingAllocator<U, Subsystem>& other) const noexcept {
+            return accounting != other.accounting;
+        }
+    };
+
+    struct MemoryBudget {
+        size_t softBytes = numeric_limits<size_t>::max();
+        size_t hardBytes = numeric_limits<size_t>::max();
+    };
+
+    MemoryBudget memoryBudgets[MemoryAccounting::kSubsystems];
+    mutex budgetMutex;
+    atomic<bool> admissionThrottled{false};
+    condition_variable admissionCV;
+    atomic<unsigned> versionRetentionCommits{1024};
+    atomic<unsigned> budgetEvictionIdleCommits{4096};
+
+    // Backoff for budget-driven GC and eviction passes that free nothing, so an
+    // over-budget engine with nothing to reclaim does not rescan every tick.
+    // Touched only by the publisher thread.
+    struct BudgetBackoff {
+        chrono::steady_clock::time_point retryAt;
+        chrono::milliseconds delay;
+
+        BudgetBackoff() : delay(0) {}
+
+        bool due(chrono::steady_clock::time_point now) const { return now >= retryAt; }
+
+        void record(bool reclaimed, chrono::steady_clock::time_point now) {
+            static constexpr chrono::milliseconds kMaxDelay{1000};
+            delay = reclaimed ? chrono::milliseconds(0)
+                              : min(kMaxDelay, max(chrono::milliseconds(10), delay * 2));
+            retryAt = now + delay;
+        }
+    };
+    BudgetBackoff gcBackoff;
+    BudgetBackoff evictionBackoff;
+
+    // Registry of readers that walk version blocks without globalLock. Readers
+    // enter the current phase's CPU-striped counter; after GC detaches blocks it
+    // flips the phase and frees them once the previous phase has drained.
+    class VersionReaders {
+    public:
+        static constexpr size_t kStripes = 16;
+
+        size_t enter() {
+            while (true) {
+                size_t phaseIndex = phase.load() & 1;
+                int cpu = sched_getcpu();
+                size_t ticket = phaseIndex * kStripes + (cpu < 0 ? 0 : static_cast<size_t>(cpu) % kStripes);
+                counters[ticket].readers.fetch_add(1);
+                if ((phase.load() & 1) == phaseIndex) return ticket;
+                counters[ticket].readers.fetch_sub(1);
+            }
+        }
+
+        void exit(size_t ticket) {
+            counters[ticket].readers.fetch_sub(1, memory_order_release);
+        }
+
+        // Returns once every reader that could have seen a block detached before
+        // the call has exited.
+        void synchronize() {
+            lock_guard<mutex> lock(synchronizeMutex);
+            size_t drained = (phase.fetch_add(1) & 1) * kStripes;
+            for (size_t i = drained; i < drained + kStripes; ++i) {
+                while (counters[i].readers.load(memory_order_acquire) != 0) {
+                    this_thread::yield();
+                }
+            }
+        }
+
+    private:
+        struct alignas(64) Counter {
+            atomic<long long> readers{0};
+        };
+
+        atomic<size_t> phase{0};
+        Counter counters[2 * kStripes];
+        mutex synchronizeMutex;
+    };
+
+    struct VersionReadGuard {
+        VersionReaders& readers;
+        size_t ticket;
+
+        explicit VersionReadGuard(VersionReaders& registry) : readers(registry), ticket(registry.enter()) {}
+        ~VersionReadGuard() { readers.exit(ticket); }
+
+        VersionReadGuard(const VersionReadGuard&) = delete;
+        VersionReadGuard& operator=(const VersionReadGuard&) = delete;
+    };
+
+    // Fixed-size block of older versions, oldest first. Blocks never move: a slot
+    // is written before count is published with a release store, and a full block
+    // is followed by a new one linked in front of it.
+    struct VersionBlock {
+        static constexpr uint32_t kCapacity = 15;
+
+        atomic<VersionBlock*> older;
+        atomic<uint32_t> count;
+        pair<unsigned, double> versions[kCapacity];
+
+        explicit VersionBlock(VersionBlock* next) : older(next), count(0) {}
+
+        static VersionBlock* create(VersionBlock* next, MemoryAccounting& accounting) {
+            accounting.add(MemorySubsystem::VersionChains, static_cast<long long>(sizeof(VersionBlock)));
+            return new VersionBlock(next);
+        }
+
+        static void destroyChain(VersionBlock* block, MemoryAccounting& accounting) {
+            while (block != nullptr) {
+                VersionBlock* next = block->older.load(memory_order_relaxed);
+                delete block;
+                accounting.add(MemorySubsystem::VersionChains, -static_cast<long long>(sizeof(VersionBlock)));
+                block = next;
+            }
+        }
+    };
+
+    // The newest version shares one cache line with a seqlock word, so current-balance
+    // reads and commit validation touch a single line. Older versions live in a
+    // chain of VersionBlocks, newest block first. Writers hold globalLock; readers
+    // need no lock, but a reader that walks the blocks must hold a VersionReadGuard.
+    class alignas(64) AccountRecord {
+    public:
+        using Version = pair<unsigned, double>;
+
+        // Version blocks are charged to accounting, the owning engine's counters.
+        explicit AccountRecord(MemoryAccounting& accounting)
+            : sequence(0), newestVersionTimestamp(0), newestVersionBalance(0.0), newestBlock(nullptr), olderCount(0),
+              accounting(&accounting) {}
+
+        AccountRecord(MemoryAccounting& accounting, unsigned timestamp, double balance) : AccountRecord(accounting) {
+            append(timestamp, balance);
+        }
+
+        AccountRecord(AccountRecord&& other) noexcept : AccountRecord(*other.accounting) {
+            *this = move(other);
+        }
+
+        AccountRecord& operator=(AccountRecord&& other) noexcept {
+            VersionBlock::destroyChain(newestBlock.load(memory_order_relaxed), *accounting);
+            accounting = other.accounting;
+            sequence.store(other.sequence.load(memory_order_relaxed), memory_order_relaxed);
+            newestVersionTimestamp.store(other.newestTimestamp(), memory_order_relaxed);
+            newestVersionBalance.store(other.newestBalance(), memory_order_relaxed);
+            newestBlock.store(other.newestBlock.exchange(nullptr, memory_order_relaxed), memory_order_relaxed);
+            olderCount = other.olderCount;
+            other.olderCount = 0;
+            return *this;
+        }
+
+        ~AccountRecord() {
+            VersionBlock::destroyChain(newestBlock.load(memory_order_relaxed), *accounting);
+        }
+
+        bool empty() const { return sequence.load(memory_order_relaxed) == 0; }
+        size_t size() const { return empty() ? 0 : olderCount + 1; }
+        unsigned newestTimestamp() const { return newestVersionTimestamp.load(memory_order_relaxed); }
+        double newestBalance() const { return newestVersionBalance.load(memory_order_relaxed); }
+
+        // Versions must be appended in timestamp order. The displaced newest version
+        // reaches its block before the seqlock publishes its replacement.
+        void append(unsigned timestamp, double balance) {
+            uint32_t current = sequence.load(memory_order_relaxed);
+            if (current != 0) {
+                VersionBlock* block = newestBlock.load(memory_order_relaxed);
+                uint32_t used = block ? block->count.load(memory_order_relaxed) : VersionBlock::kCapacity;
+                if (used == VersionBlock::kCapacity) {
+                    block = VersionBlock::create(block, *accounting);
+                    block->versions[0] = Version(newestTimestamp(), newestBalance());
+                    block->count.store(1, memory_order_relaxed);
+                    newestBlock.store(block, memory_order_release);
+                } else {
+                    block->versions[used] = Version(newestTimestamp(), newestBalance());
+                    block->count.store(used + 1, memory_order_release);
+                }
+                ++olderCount;
+            }
+            sequence.store(current + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            newestVersionTimestamp.store(timestamp, memory_order_relaxed);
+            newestVersionBalance.store(balance, memory_order_relaxed);
+            sequence.store(current + 2, memory_order_release);
+        }
+
+        // Lock-free. Returns false while the record is empty.
+        bool readNewest(Version& version) const {
+            while (true) {
+                uint32_t before = sequence.load(memory_order_acquire);
+                if (before == 0) return false;
+                if (before & 1) continue;
+                version = Version(newestTimestamp(), newestBalance());
+                atomic_thread_fence(memory_order_acquire);
+                if (sequence.load(memory_order_relaxed) == before) return true;
+            }
+        }
+
+        // Newest version with a timestamp at or below asOf. Without globalLock the
+        // caller must hold a VersionReadGuard.
+        bool versionAt(unsigned asOf, Version& found) const {
+            if (!readNewest(found)) return false;
+            if (found.first <= asOf) return true;
+            for (const VersionBlock* block = newestBlock.load(memory_order_acquire); block != nullptr;
+                 block = block->older.load(memory_order_acquire)) {
+                for (uint32_t i = block->count.load(memory_order_acquire); i > 0; --i) {
+                    if (block->versions[i - 1].first <= asOf) {
+                        found = block->versions[i - 1];
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        // Appends every version with a timestamp at or below asOf to out, oldest first.
+        // Requires globalLock.
+        void visibleVersions(unsigned asOf, vector<Version>& out) const {
+            if (empty()) return;
+            size_t first = out.size();
+            if (newestTimestamp() <= asOf) out.emplace_back(newestTimestamp(), newestBalance());
+            for (const VersionBlock* block = newestBlock.load(memory_order_relaxed); block != nullptr;
+                 block = block->older.load(memory_order_relaxed)) {
+                for (uint32_t i = block->count.load(memory_order_relaxed); i > 0; --i) {
+                    if (block->versions[i - 1].first <= asOf) out.push_back(block->versions[i - 1]);
+                }
+            }
+            reverse(out.begin() + static_cast<ptrdiff_t>(first), out.end());
+        }
+
+        vector<Version> versions() const {
+            vector<Version> all;
+            visibleVersions(numeric_limits<unsigned>::max(), all);
+            return all;
+        }
+
+        // Detaches the whole blocks that hold only versions older than the newest
+        // version at or below horizon and returns them for deferred deletion.
+        // Requires globalLock.
+        VersionBlock* detachBefore(unsigned horizon, size_t& dropped) {
+            dropped = 0;
+            atomic<VersionBlock*>* link = &newestBlock;
+            if (empty() || newestTimestamp() > horizon) {
+                VersionBlock* block = newestBlock.load(memory_order_relaxed);
+                while (block != nullptr && block->versions[0].first > horizon) {
+                    link = &block->older;
+                    block = block->older.load(memory_order_relaxed);
+                }
+                if (block == nullptr) return nullptr;
+                link = &block->older;
+            }
+            VersionBlock* detached = link->load(memory_order_relaxed);
+            if (detached == nullptr) return nullptr;
+            link->store(nullptr, memory_order_release);
+            for (VersionBlock* block = detached; block != nullptr; block = block->older.load(memory_order_relaxed)) {
+                dropped += block->count.load(memory_order_relaxed);
+            }
+            olderCount -= static_cast<uint32_t>(dropped);
+            return detached;
+        }
+
+    private:
+        atomic<uint32_t> sequence;   // odd while the newest version is replaced, 0 until the first append
+        atomic<unsigned> newestVersionTimestamp;
+        atomic<double> newestVersionBalance;
+        atomic<VersionBlock*> newestBlock;
+        uint32_t olderCount;
+        MemoryAccounting* accounting;
+    };
+    static_assert(sizeof(AccountRecord) == 64, "AccountRecord must fill exactly one cache line");
+
+    map<unsigned, AccountRecord, less<unsigned>,
+        TrackingAllocator<pair<const unsigned, AccountRecord>, MemorySubsystem::AccountIndex>> versionedData;
+
+    // Hash index from account ID to its resident AccountRecord, kept in step with
+    // versionedData under globalLock. Lookups are lock-free so that workers can
+    // prefetch for queued transactions without globalLock; a lock-free result is
+    // only a hint, and a lock-free reader must hold a VersionReadGuard. Tables
+    // replaced on growth are retired and freed after a reader grace period.
+    class AccountLookupTable {
+    public:
+        explicit AccountLookupTable(MemoryAccounting& owner)
+            : accounting(owner), owned(new Table(64, owner)) {
+            current.store(owned.get());
+        }
+
+        AccountRecord* find(unsigned accountId) const {
+            const Slot* slot = probe(*current.load(memory_order_acquire), accountId);
+            return slot ? slot->record.load(memory_order_acquire) : nullptr;
+        }
+
+        const void* slotAddress(unsigned accountId) const {
+            const Table* table = current.load(memory_order_acquire);
+            return &table->slots[slotFor(accountId, table->mask)];
+        }
+
+        // Requires globalLock, as do erase and reserve.
+        void insert(unsigned accountId, AccountRecord* record) {
+            Table* table = current.load(memory_order_relaxed);
+            uint64_t key = uint64_t{accountId} + 1;
+            for (size_t index = slotFor(accountId, table->mask);; index = (index + 1) & table->mask) {
+                Slot& slot = table->slots[index];
+                uint64_t existing = slot.key.load(memory_order_relaxed);
+                if (existing == key) {
+                    slot.record.store(record, memory_order_release);
+                    return;
+                }
+                if (existing == 0) {
+                    if ((used + 1) * 2 > table->mask + 1) {
+                        rehash(used + 1);
+                        insert(accountId, record);
+                        return;
+                    }
+                    slot.record.store(record, memory_order_relaxed);
+                    slot.key.store(key, memory_order_release);
+                    ++used;
+                    return;
+                }
+            }
+        }
+
+        void erase(unsigned accountId) {
+            Table* table = current.load(memory_order_relaxed);
+            if (Slot* slot = probe(*table, accountId)) {
+                slot->record.store(nullptr, memory_order_release);
+            }
+        }
+
+        void reserve(size_t accounts) {
+            if ((used + accounts) * 2 > current.load(memory_order_relaxed)->mask + 1) {
+                rehash(used + accounts);
+            }
+        }
+
+    private:
+        struct Table;
+
+    public:
+        // Requires globalLock. Hands over the tables replaced since the last call;
+        // they may be freed only after versionReaders.synchronize().
+        vector<unique_ptr<Table>> takeRetired() {
+            vector<unique_ptr<Table>> taken;
+            taken.swap(retired);
+            return taken;
+        }
+
+        // Lock-free view of the table current when it was taken. The view stays
+        // readable after growth while its VersionReadGuard is held, but it only
+        // shows accounts inserted into its own table.
+        class View {
+        public:
+            size_t capacity() const { return table->mask + 1; }
+
+            // Records are prefetched kPrefetchDistance slots ahead of the visitor.
+            template <typename Visitor>
+            void visit(size_t firstSlot, size_t endSlot, Visitor&& visitor) const {
+                static constexpr size_t kPrefetchDistance = 16;
+                for (size_t index = firstSlot; index < min(endSlot, firstSlot + kPrefetchDistance); ++index) {
+                    __builtin_prefetch(table->slots[index].record.load(memory_order_relaxed));
+                }
+                for (size_t index = firstSlot; index < endSlot; ++index) {
+                    if (index + kPrefetchDistance < endSlot) {
+                        __builtin_prefetch(table->slots[index + kPrefetchDistance].record.load(memory_order_relaxed));
+                    }
+                    uint64_t key = table->slots[index].key.load(memory_order_acquire);
+                    if (key == 0) continue;
+                    if (const AccountRecord* record = table->slots[index].record.load(memory_order_acquire)) {
+                        visitor(static_cast<unsigned>(key - 1), *record);
+                    }
+                }
+            }
+
+        private:
+            friend class AccountLookupTable;
+            explicit View(const Table* viewed) : table(viewed) {}
+            const Table* table;
+        };
+
+        View view() const {
+            return View(current.load(memory_order_acquire));
+        }
+
+    private:
+        // Erased accounts keep their key with a null record and are dropped on rehash.
+        struct Slot {
+            atomic<uint64_t> key{0};   // accountId + 1, or 0 while empty
+            atomic<AccountRecord*> record{nullptr};
+        };
+
+        struct Table {
+            size_t mask;
+            unique_ptr<Slot[]> slots;
+
+            MemoryAccounting& accounting;
+
+            Table(size_t capacity, MemoryAccounting& owner)
+                : mask(capacity - 1), slots(new Slot[capacity]), accounting(owner) {
+                accounting.add(MemorySubsystem::AccountIndex, static_cast<long long>(capacity * sizeof(Slot)));
+            }
+
+            ~Table() {
+                accounting.add(MemorySubsystem::AccountIndex, -static_cast<long long>((mask + 1) * sizeof(Slot)));
+            }
+        };
+
+        MemoryAccounting& accounting;
+
+        atomic<Table*> current{nullptr};
+        unique_ptr<Table> owned;             // the table current points to
+        vector<unique_ptr<Table>> retired;   // replaced, awaiting a reader grace period
+        size_t used = 0;
+
+        static size_t slotFor(unsigned accountId, size_t mask) {
+            return (static_cast<size_t>(accountId) * 0x9E3779B97F4A7C15ull >> 17) & mask;
+        }
+
+        static Slot* probe(const Table& table, unsigned accountId) {
+            uint64_t key = uint64_t{accountId} + 1;
+            for (size_t index = slotFor(accountId, table.mask);; index = (index + 1) & table.mask) {
+                Slot& slot = table.slots[index];
+                uint64_t existing = slot.key.load(memory_order_acquire);
+                if (existing == key) return &slot;
+                if (existing == 0) return nullptr;
+            }
+        }
+
+        void rehash(size_t accounts) {
+            const Table& old = *current.load(memory_order_relaxed);
+            size_t live = 0;
+            for (size_t i = 0; i <= old.mask; ++i) {
+                live += old.slots[i].record.load(memory_order_relaxed) != nullptr;
+            }
+            size_t capacity = 64;
+            while (capacity < max(accounts, live + 1) * 4) {
+                capacity <<= 1;
+            }
+            unique_ptr<Table> table(new Table(capacity, accounting));
+            used = 0;
+            for (size_t i = 0; i <= old.mask; ++i) {
+                AccountRecord* record = old.slots[i].record.load(memory_order_relaxed);
+                if (record == nullptr) continue;
+                uint64_t key = old.slots[i].key.load(memory_order_relaxed);
+                size_t index = slotFor(static_cast<unsigned>(key - 1), table->mask);
+                while (table->slots[index].key.load(memory_order_relaxed) != 0) {
+                    index = (index + 1) & table->mask;
+                }
+                table->slots[index].record.store(record, memory_order_relaxed);
+                table->slots[index].key.store(key, memory_order_relaxed);
+                ++used;
+            }
+            current.store(table.get(), memory_order_release);
+            retired.push_back(move(owned));
+            owned = move(table);
+        }
+    };
+
+    AccountLookupTable accountLookup;
+    VersionReaders versionReaders;
+    atomic<unsigned> prefetchDepth{4};
+    mutex globalLock;
+    mt19937 rng;
+
+    vector<thread> workerThreads;
+    unsigned workerCount;
+    FairTransactionQueue transactionQueue;
+    mutex queueMutex;
+    condition_variable queueCV;
+    atomic<bool> shutdownFlag{false};
+    atomic<unsigned> globalClock{0};
+    atomic<int> activeTransactions{0};
+    atomic<size_t> droppedTransactions{0};
+    atomic<bool> transactionLogging{true};
+    ClientRateLimiter rateLimiter;
+    atomic<size_t> rateLimitedSubmissions{0};
+    atomic<IsolationLevel> isolationLevel{IsolationLevel::Serializable};
+
+    // Committed transactions still concurrent with some active snapshot, used by
+    // SerializableSnapshot to find dangerous structures. Guarded by globalLock.
+    struct CommittedTransaction {
+        unsigned startTimestamp;
+        unsigned commitTimestamp;
+        vector<unsigned> readKeys;
+        vector<unsigned> writeKeys;
+        bool inConflict;
+        bool outConflict;
+    };
+    deque<CommittedTransaction> recentCommits;
+    multiset<unsigned> activeSnapshots;
+
+    // Write-set claims of running transactions under PriorityWound. Lock order is
+    // globalLock before claimsMutex.
+    struct AccountClaim {
+        int priority;
+        uint64_t owner;
+    };
+    atomic<ConflictResolution> conflictResolution{ConflictResolution::FirstCommitterWins};
+    mutex claimsMutex;
+    unordered_map<unsigned, AccountClaim> accountClaims;
+    atomic<uint64_t> nextTransactionSerial{1};
+
+    // Dormant accounts evicted from versionedData live in an append-only file.
+    // coldIndex is only modified with both globalLock and coldMutex held, so
+    // either lock is enough to read it. Lock order is globalLock before coldMutex.
+    struct ColdRecordHeader {
+        uint32_t accountId;
+        uint32_t versionCount;
+    };
+
+    struct ColdVersion {
+        uint32_t timestamp;
+        uint32_t reserved;
+        double balance;
+    };
+
+    struct ColdLocation {
+        uint64_t offset;
+        uint32_t versionCount;
+        unsigned newestTimestamp;
+        double newestBalance;
+    };
+
+    mutex coldMutex;
+    atomic<int> coldStoreFd{-1};
+    uint64_t coldStoreEnd = 0;
+    unordered_map<unsigned, ColdLocation, hash<unsigned>, equal_to<unsigned>,
+                  TrackingAllocator<pair<const unsigned, ColdLocation>, MemorySubsystem::ColdIndex>> coldIndex;
+    unique_ptr<atomic<uint64_t>[]> coldFilter;
+    atomic<size_t> coldFilterBits{0};
+    static constexpr unsigned kColdFilterHashes = 4;
+    atomic<int> activeScans{0};
+
+    // Instruments whose position accounts are frozen by a corporate action. Guarded
+    // by globalLock; queued work whose commit writes a frozen position is parked
+    // per instrument and re-queued by the thaw, so workers never wait on a freeze.
+    unordered_set<unsigned> frozenInstruments;
+    unordered_map<unsigned, vector<TransactionInfo>> parkedTransactions;   // guarded by globalLock
+    atomic<size_t> frozenInstrumentCount{0};
+    mutex corporateActionMutex;
+    mutex thawMutex;
+    condition_variable thawCV;
+    unordered_map<unsigned, unsigned> pinnedAccounts;   // guarded by globalLock
+
+    // Immutable open-addressing table of newest balances, replaced wholesale on publish.
+    // A later entry for the same account replaces an earlier one.
+    struct BalanceSnapshot {
+        static constexpr unsigned kEmptySlot = numeric_limits<unsigned>::max();
+
+        struct Slot {
+            unsigned accountId;
+            double balance;
+        };
+
+        vector<Slot, TrackingAllocator<Slot, MemorySubsystem::Snapshots>> slots;
+        size_t mask;
+        unsigned asOfTimestamp;
+        chrono::steady_clock::time_point asOf;
+
+        BalanceSnapshot(const vector<pair<unsigned, double>>& balances, unsigned timestamp,
+                        chrono::steady_clock::time_point time, MemoryAccounting& accounting)
+            : slots(decltype(slots)::allocator_type(accounting)), asOfTimestamp(timestamp), asOf(time) {
+            size_t capacity = 16;
+            while (capacity < balances.size() * 2) {
+                capacity <<= 1;
+            }
+            slots.assign(capacity, Slot{kEmptySlot, 0.0});
+            mask = capacity - 1;
+            for (const auto& entry : balances) {
+                size_t index = slotFor(entry.first);
+                while (slots[index].accountId != kEmptySlot && slots[index].accountId != entry.first) {
+                    index = (index + 1) & mask;
+                }
+                slots[index] = Slot{entry.first, entry.second};
+            }
+        }
+
+        size_t slotFor(unsigned accountId) const {
+            return (static_cast<size_t>(accountId) * 0x9E3779B97F4A7C15ull >> 17) & mask;
+        }
+
+        const Slot* find(unsigned accountId) const {
+            for (size_t index = slotFor(accountId);; index = (index + 1) & mask) {
+                const Slot& slot = slots[index];
+                if (slot.accountId == accountId) return &slot;
+                if (slot.accountId == kEmptySlot) return nullptr;
+            }
+        }
+    };
+
+    shared_ptr<const BalanceSnapshot> balanceSnapshot;
+
+    // Flat tables compiled from a FeeSchedule: open-addressing maps from account to
+    // tier and from instrument to column, bracket lower bounds padded with +inf so
+    // the bracket is found without data-dependent branches, and one rate per
+    // (tier, column, bracket). Column 0 holds the rates for unlisted instruments.
+    class CompiledFeeSchedule {
+    public:
+        explicit CompiledFeeSchedule(const FeeSchedule& schedule) : feeAccount(schedule.feeAccountId) {
+            vector<unsigned> instruments;
+            vector<double> lowerBounds{-numeric_limits<double>::infinity()};
+            unsigned highestTier = 0;
+            for (const auto& rule : schedule.rules) {
+                if (rule.instrument != kAnyInstrument) instruments.push_back(rule.instrument);
+                lowerBounds.push_back(rule.minNotional);
+                highestTier = max(highestTier, rule.tier);
+            }
+            for (const auto& entry : schedule.accountTiers) {
+                highestTier = max(highestTier, entry.second);
+            }
+            sort(instruments.begin(), instruments.end());
+            instruments.erase(unique(instruments.begin(), instruments.end()), instruments.end());
+            sort(lowerBounds.begin(), lowerBounds.end());
+            lowerBounds.erase(unique(lowerBounds.begin(), lowerBounds.end()), lowerBounds.end());
+            if (highestTier >= FeeSchedule::kMaxTiers) {
+                throw invalid_argument("Fee tiers must be below " + to_string(FeeSchedule::kMaxTiers));
+            }
+            unsigned tiers = highestTier + 1;
+            if (lowerBounds.size() > FeeSchedule::kMaxBrackets) {
+                throw invalid_argument("Fee schedule uses more than " + to_string(FeeSchedule::kMaxBrackets - 1) +
+                                       " volume brackets");
+            }
+
+            fill(begin(thresholds), end(thresholds), numeric_limits<double>::infinity());
+            copy(lowerBounds.begin(), lowerBounds.end(), begin(thresholds));
+            columns = static_cast<unsigned>(instruments.size()) + 1;
+            rates.assign(size_t{tiers} * columns * FeeSchedule::kMaxBrackets, FeeRate{0.0, 0.0});
+            for (unsigned tier = 0; tier < tiers; ++tier) {
+                for (unsigned column = 0; column < columns; ++column) {
+                    unsigned instrument = column == 0 ? kAnyInstrument : instruments[column - 1];
+                    for (unsigned bracket = 0; bracket < lowerBounds.size(); ++bracket) {
+                        const FeeRule* best = nullptr;
+                        for (const auto& rule : schedule.rules) {
+                            if (rule.tier != tier || rule.minNotional > lowerBounds[bracket] ||
+                                (rule.instrument != kAnyInstrument && rule.instrument != instrument)) {
+                                continue;
+                            }
+                            if (best == nullptr ||
+                                make_pair(rule.instrument != kAnyInstrument, rule.minNotional) >=
+                                    make_pair(best->instrument != kAnyInstrument, best->minNotional)) {
+                                best = &rule;
+                            }
+                        }
+                        if (best != nullptr) {
+                            rates[(size_t{tier} * columns + column) * FeeSchedule::kMaxBrackets + bracket] =
+                                FeeRate{best->basisPoints * 1e-4, best->flatFee};
+                        }
+                    }
+                }
+            }
+
+            vector<pair<unsigned, unsigned>> tierEntries(schedule.accountTiers.begin(), schedule.accountTiers.end());
+            tierMask = buildTable(tierSlots, tierEntries);
+            vector<pair<unsigned, unsigned>> columnEntries;
+            for (unsigned column = 1; column < columns; ++column) {
+                columnEntries.emplace_back(instruments[column - 1], column);
+            }
+            columnMask = buildTable(columnSlots, columnEntries);
+        }
+
+        unsigned feeAccountId() const { return feeAccount; }
+
+        double fee(unsigned accountId, unsigned instrument, double notional) const {
+            unsigned tier = lookup(tierSlots, tierMask, accountId);
+            unsigned column = lookup(columnSlots, columnMask, instrument);
+            unsigned bracket = 0;
+            for (unsigned i = 1; i < FeeSchedule::kMaxBrackets; ++i) {
+                bracket += notional >= thresholds[i];
+            }
+            const FeeRate& rate = rates[(size_t{tier} * columns + column) * FeeSchedule::kMaxBrackets + bracket];
+            return notional * rate.fraction + rate.flatFee;
+        }
+
+    private:
+        static constexpr unsigned kEmptySlot = numeric_limits<unsigned>::max();
+
+        struct KeySlot {
+            unsigned key;
+            unsigned value;   // kEmptySlot while unused
+        };
+
+        struct FeeRate {
+            double fraction;
+            double flatFee;
+        };
+
+        unsigned feeAccount;
+        vector<KeySlot> tierSlots;
+        size_t tierMask;
+        vector<KeySlot> columnSlots;
+        size_t columnMask;
+        double thresholds[FeeSchedule::kMaxBrackets];
+        unsigned columns;
+        vector<FeeRate> rates;
+
+        static size_t slotFor(unsigned key, size_t mask) {
+            return (static_cast<size_t>(key) * 0x9E3779B97F4A7C15ull >> 17) & mask;
+        }
+
+        static size_t buildTable(vector<KeySlot>& slots, const vector<pair<unsigned, unsigned>>& entries) {
+            size_t capacity = 16;
+            while (capacity < entries.size() * 2) {
+                capacity <<= 1;
+            }
+            slots.assign(capacity, KeySlot{0, kEmptySlot});
+            for (const auto& entry : entries) {
+                size_t index = slotFor(entry.first, capacity - 1);
+                while (slots[index].value != kEmptySlot) {
+                    index = (index + 1) & (capacity - 1);
+                }
+                slots[index] = KeySlot{entry.first, entry.second};
+            }
+            return capacity - 1;
+        }
+
+        // Returns 0, the default tier and column, for absent keys.
+        static unsigned lookup(const vector<KeySlot>& slots, size_t mask, unsigned key) {
+            for (size_t index = slotFor(key, mask);; index = (index + 1) & mask) {
+                if (slots[index].value == kEmptySlot) return 0;
+                if (slots[index].key == key) return slots[index].value;
+            }
+        }
+    };
+
+    shared_ptr<const CompiledFeeSchedule> feeSchedule;
+
+    // Latest quote per instrument, kept outside versionedData: no history, no
+    // transactions. Each instrument has its own cache line with a seqlock, one
+    // publisher per instrument at a time, and lock-free readers that retry only
+    // while an update is in progress.
+    class QuoteStore {
+    public:
+        QuoteStore() : slots(new Slot[kMaxQuotedInstruments]) {}
+
+        void publish(unsigned instrument, const Quote& quote) {
+            Slot& slot = slots[instrument];
+            uint32_t current = slot.sequence.load(memory_order_relaxed);
+            slot.sequence.store(current + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            slot.bid.store(quote.bid, memory_order_relaxed);
+            slot.bidSize.store(quote.bidSize, memory_order_relaxed);
+            slot.ask.store(quote.ask, memory_order_relaxed);
+            slot.askSize.store(quote.askSize, memory_order_relaxed);
+            slot.sequence.store(current + 2, memory_order_release);
+        }
+
+        // Returns false until the instrument's first quote is published.
+        bool read(unsigned instrument, Quote& quote) const {
+            const Slot& slot = slots[instrument];
+            while (true) {
+                uint32_t before = slot.sequence.load(memory_order_acquire);
+                if (before == 0) return false;
+                if (before & 1) continue;
+                quote = Quote{slot.bid.load(memory_order_relaxed), slot.bidSize.load(memory_order_relaxed),
+                              slot.ask.load(memory_order_relaxed), slot.askSize.load(memory_order_relaxed)};
+                atomic_thread_fence(memory_order_acquire);
+                if (slot.sequence.load(memory_order_relaxed) == before) return true;
+            }
+        }
+
+    private:
+        struct alignas(64) Slot {
+            atomic<uint32_t> sequence{0};   // 0 until published, odd while being written
+            atomic<double> bid{0.0};
+            atomic<double> bidSize{0.0};
+            atomic<double> ask{0.0};
+            atomic<double> askSize{0.0};
+        };
+        static_assert(sizeof(Slot) == 64, "Quote slot must fill one cache line");
+
+        unique_ptr<Slot[]> slots;
+    };
+
+    QuoteStore quoteStore;
+
+    // Aggregated depth per instrument, published to a shared-memory ring as level
+    // deltas and trade prints. An instrument's full book follows every
+    // snapshotEvery of its level updates, so late joiners can start from there.
+    // Requires marketDataMutex.
+    class MarketDataFeed {
+    public:
+        MarketDataFeed(const string& path, size_t capacity, unsigned snapshotEvery)
+            : capacity(capacity), snapshotEvery(snapshotEvery) {
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                throw runtime_error("Cannot open " + path);
+            }
+            length = sizeof(MarketDataHeader) + capacity * sizeof(MarketDataSlot);
+            void* mapping = MAP_FAILED;
+            if (ftruncate(fd, static_cast<off_t>(length)) == 0) {
+                mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                throw runtime_error("Cannot map " + path);
+            }
+            header = static_cast<MarketDataHeader*>(mapping);
+            slots = reinterpret_cast<MarketDataSlot*>(header + 1);
+            header->capacity = capacity;
+            header->published.store(0, memory_order_relaxed);
+            header->magic = MarketDataHeader::kMagic;
+        }
+
+        ~MarketDataFeed() {
+            munmap(header, length);
+            close(fd);
+        }
+
+        MarketDataFeed(const MarketDataFeed&) = delete;
+        MarketDataFeed& operator=(const MarketDataFeed&) = delete;
+
+        void updateLevel(unsigned instrument, BookSide side, double price, double size) {
+            DepthBook& book = books[instrument];
+            if (side == BookSide::Bid) {
+                setLevel(book.bids, price, size);
+            } else {
+                setLevel(book.asks, price, size);
+            }
+            append(instrument, MarketDataType::LevelUpdate, side, price, size);
+            if (++book.updatesSinceSnapshot >= snapshotEvery) {
+                snapshot(instrument, book);
+            }
+        }
+
+        void trade(unsigned instrument, double price, double quantity) {
+            append(instrument, MarketDataType::Trade, BookSide::Bid, price, quantity);
+        }
+
+        void snapshotAll() {
+            for (auto& entry : books) {
+                snapshot(entry.first, entry.second);
+            }
+        }
+
+    private:
+        struct DepthBook {
+            map<double, double, greater<double>> bids;
+            map<double, double> asks;
+            unsigned updatesSinceSnapshot;
+
+            DepthBook() : updatesSinceSnapshot(0) {}
+        };
+
+        int fd = -1;
+        size_t length = 0;
+        MarketDataHeader* header = nullptr;
+        MarketDataSlot* slots = nullptr;
+        size_t capacity;
+        unsigned snapshotEvery;
+        uint64_t sequence = 0;
+        unordered_map<unsigned, DepthBook> books;
+
+        template <typename Levels>
+        static void setLevel(Levels& levels, double price, double size) {
+            if (size > 0.0) {
+                levels[price] = size;
+            } else {
+                levels.erase(price);
+            }
+        }
+
+        void append(unsigned instrument, MarketDataType type, BookSide side, double price, double size) {
+            ++sequence;
+            slots[(sequence - 1) % capacity].write(MarketDataMessage{sequence, instrument, type, side, 0, price, size});
+            header->published.store(sequence, memory_order_release);
+        }
+
+        void snapshot(unsigned instrument, DepthBook& book) {
+            append(instrument, MarketDataType::SnapshotStart, BookSide::Bid, 0.0,
+                   static_cast<double>(book.bids.size() + book.asks.size()));
+            for (const auto& level : book.bids) {
+                append(instrument, MarketDataType::SnapshotLevel, BookSide::Bid, level.first, level.second);
+            }
+            for (const auto& level : book.asks) {
+                append(instrument, MarketDataType::SnapshotLevel, BookSide::Ask, level.first, level.second);
+            }
+            append(instrument, MarketDataType::SnapshotEnd, BookSide::Bid, 0.0, 0.0);
+            book.updatesSinceSnapshot = 0;
+        }
+    };
+
+    mutex marketDataMutex;
+    unique_ptr<MarketDataFeed> marketDataFeed;
+
+    enum class OrderFlowStatus : uint8_t { Accepted, RejectedByRisk, Settled, Failed };
+
+    struct alignas(64) OrderFlowEntry {
+        OrderFlowRecord record;
+        OrderFlowStatus status;
+    };
+
+    struct alignas(64) OrderFlowSequence {
+        atomic<uint64_t> value{0};   // highest sequence a stage has finished
+    };
+
+    // Single-producer ring: submitOrder publishes entries to orderFlowCursor, and
+    // the journal, risk and settlement stages each consume them in place, in
+    // that order, advancing their own sequence. The producer reuses a slot only
+    // after settlement has passed it.
+    static constexpr size_t kOrderFlowSettlementBatch = 64;
+    unique_ptr<OrderFlowEntry[]> orderFlowEntries;
+    size_t orderFlowMask = 0;
+    uint64_t orderFlowNext = 0;   // producer only
+    OrderFlowSequence orderFlowCursor;
+    OrderFlowSequence orderFlowJournaled;
+    OrderFlowSequence orderFlowRiskChecked;
+    OrderFlowSequence orderFlowSettled;
+    int orderFlowJournalFd = -1;
+    double orderFlowMaxNotional = 0.0;
+    atomic<bool> orderFlowStop{false};
+    atomic<size_t> orderFlowRejected{0};
+    atomic<size_t> orderFlowFailed{0};
+    mutex orderFlowErrorMutex;
+    string orderFlowError;
+    vector<thread> orderFlowStages;
+
+    struct ResolvedLeg {
+        unsigned accountId;
+        double amount;
+        bool nonNegative;
+    };
+
+    struct ExposureDelta {
+        uint64_t pair;   // lower account ID in the high half
+        double gross;
+        double net;      // from the lower account's side
+    };
+
+    // Bilateral exposure between accounts that trade with each other. Commits
+    // append deltas to a per-CPU buffer, so trades never share a lock; merge()
+    // folds the buffers into a hash of account pairs, and each account keeps a
+    // list of its counterparties so that a row costs one lookup per entry.
+    class ExposureMatrix {
+    public:
+        static constexpr size_t kStripes = 16;
+
+        static uint64_t pairKey(unsigned a, unsigned b) {
+            return a < b ? (uint64_t{a} << 32) | b : (uint64_t{b} << 32) | a;
+        }
+
+        void record(const vector<ExposureDelta>& deltas) {
+            int cpu = sched_getcpu();
+            Stripe& stripe = stripes[cpu < 0 ? 0 : static_cast<size_t>(cpu) % kStripes];
+            lock_guard<mutex> lock(stripe.lock);
+            stripe.deltas.insert(stripe.deltas.end(), deltas.begin(), deltas.end());
+        }
+
+        // Returns the pairs whose gross or absolute net exposure reached its limit
+        // during this merge, from the lower account's side.
+        vector<ExposureAlert> merge(double grossLimit, double netLimit) {
+            vector<ExposureAlert> alerts;
+            vector<ExposureDelta> pending;
+            for (auto& stripe : stripes) {
+                {
+                    lock_guard<mutex> lock(stripe.lock);
+                    if (stripe.deltas.empty()) continue;
+                    pending.swap(stripe.deltas);
+                }
+                lock_guard<mutex> lock(matrixMutex);
+                for (const auto& delta : pending) {
+                    auto result = pairs.emplace(delta.pair, Aggregate{0.0, 0.0});
+                    Aggregate& aggregate = result.first->second;
+                    unsigned low = static_cast<unsigned>(delta.pair >> 32);
+                    unsigned high = static_cast<unsigned>(delta.pair);
+                    if (result.second) {
+                        counterparties[low].push_back(high);
+                        counterparties[high].push_back(low);
+                    }
+                    bool below = aggregate.gross < grossLimit && fabs(aggregate.net) < netLimit;
+                    aggregate.gross += delta.gross;
+                    aggregate.net += delta.net;
+                    if (below && (aggregate.gross >= grossLimit || fabs(aggregate.net) >= netLimit)) {
+                        alerts.push_back(ExposureAlert{low, CounterpartyExposure{high, aggregate.gross, aggregate.net}});
+                    }
+                }
+                pending.clear();
+            }
+            return alerts;
+        }
+
+        vector<CounterpartyExposure> row(unsigned accountId) const {
+            vector<CounterpartyExposure> result;
+            lock_guard<mutex> lock(matrixMutex);
+            auto list = counterparties.find(accountId);
+            if (list == counterparties.end()) return result;
+            result.reserve(list->second.size());
+            for (unsigned other : list->second) {
+                result.push_back(orient(accountId, other, pairs.at(pairKey(accountId, other))));
+            }
+            return result;
+        }
+
+        CounterpartyExposure between(unsigned accountId, unsigned counterparty) const {
+            lock_guard<mutex> lock(matrixMutex);
+            auto found = pairs.find(pairKey(accountId, counterparty));
+            if (found == pairs.end()) return CounterpartyExposure{counterparty, 0.0, 0.0};
+            return orient(accountId, counterparty, found->second);
+        }
+
+    private:
+        struct Aggregate {
+            double gross;
+            double net;
+        };
+
+        struct alignas(64) Stripe {
+            mutex lock;
+            vector<ExposureDelta> deltas;
+        };
+
+        Stripe stripes[kStripes];
+        mutable mutex matrixMutex;
+        unordered_map<uint64_t, Aggregate> pairs;
+        unordered_map<unsigned, vector<unsigned>> counterparties;
+
+        static CounterpartyExposure orient(unsigned accountId, unsigned other, const Aggregate& aggregate) {
+            return CounterpartyExposure{other, aggregate.gross, accountId < other ? aggregate.net : -aggregate.net};
+        }
+    };
+
+    ExposureMatrix exposureMatrix;
+    mutex exposureAlertMutex;
+    double exposureGrossLimit = numeric_limits<double>::infinity();
+    double exposureNetLimit = numeric_limits<double>::infinity();
+    function<void(const ExposureAlert&)> exposureAlertHandler;
+    mutex snapshotPublishMutex;
+    mutex snapshotMutex;
+    condition_variable snapshotCV;
+    atomic<long long> snapshotIntervalMicros{5000};
+    atomic<bool> balanceSnapshotsEnabled{false};
+    thread snapshotPublisher;
+
+    class MappedFile {
+    public:
+        explicit MappedFile(const string& path) {
+            fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw runtime_error("Cannot open " + path);
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                close(fd);
+                throw runtime_error("Cannot stat " + path);
+            }
+            length = static_cast<size_t>(info.st_size);
+            if (length > 0) {
+                void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping == MAP_FAILED) {
+                    close(fd);
+                    throw runtime_error("Cannot map " + path);
+                }
+                madvise(mapping, length, MADV_SEQUENTIAL);
+                bytes = static_cast<const char*>(mapping);
+            }
+        }
+
+        ~MappedFile() {
+            if (bytes != nullptr) {
+                munmap(const_cast<char*>(bytes), length);
+            }
+            close(fd);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        int fd = -1;
+        const char* bytes = nullptr;
+        size_t length = 0;
+    };
+
+    // Splits a CSV buffer into records by locating ',' and '\n' 64 bytes at a time
+    // with AVX2 or SSE2 compares, falling back to a scalar scan without either.
+    class CsvScanner {
+    public:
+        static constexpr size_t kBlockSize = 64;
+
+        CsvScanner(const char* begin, const char* end)
+            : base(begin), length(static_cast<size_t>(end - begin)) {}
+
+        // Returns the number of fields in the next record, or 0 at end of input. Only
+        // the first maxFields are stored, so a count above maxFields marks a row with
+        // extra fields.
+        size_t nextRecord(const char** fields, size_t* lengths, size_t maxFields) {
+            if (fieldStart >= length) return 0;
+            size_t count = 0;
+            size_t position;
+            do {
+                position = nextStructural();
+                if (count < maxFields) {
+                    fields[count] = base + fieldStart;
+                    lengths[count] = position - fieldStart;
+                }
+                ++count;
+                fieldStart = position + 1;
+            } while (position < length && base[position] == ',');
+            if (count <= maxFields && lengths[count - 1] > 0 &&
+                fields[count - 1][lengths[count - 1] - 1] == '\r') {
+                --lengths[count - 1];
+            }
+            return count;
+        }
+
+    private:
+        const char* base;
+        size_t length;
+        size_t fieldStart = 0;
+        size_t blockOffset = 0;
+        bool blockLoaded = false;
+        uint64_t mask = 0;
+
+        size_t nextStructural() {
+            while (mask == 0) {
+                if (blockLoaded) blockOffset += kBlockSize;
+                blockLoaded = true;
+                if (blockOffset >= length) return length;
+                mask = structuralMask(base + blockOffset, min(kBlockSize, length - blockOffset));
+            }
+            size_t position = blockOffset + static_cast<size_t>(__builtin_ctzll(mask));
+            mask &= mask - 1;
+            return position;
+        }
+
+        static uint64_t structuralMask(const char* block, size_t size) {
+            if (size == kBlockSize) {
+#if defined(__AVX2__)
+                const __m256i comma = _mm256_set1_epi8(',');
+                const __m256i newline = _mm256_set1_epi8('\n');
+                __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+                __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32));
+                uint32_t lowMask = static_cast<uint32_t>(_mm256_movemask_epi8(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(low, comma), _mm256_cmpeq_epi8(low, newline))));
+                uint32_t highMask = static_cast<uint32_t>(_mm256_movemask_epi8(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(high, comma), _mm256_cmpeq_epi8(high, newline))));
+                return static_cast<uint64_t>(highMask) << 32 | lowMask;
+#elif defined(__SSE2__)
+                const __m128i comma = _mm_set1_epi8(',');
+                const __m128i newline = _mm_set1_epi8('\n');
+                uint64_t result = 0;
+                for (size_t lane = 0; lane < 4; ++lane) {
+                    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + lane * 16));
+                    uint32_t laneMask = static_cast<uint32_t>(_mm_movemask_epi8(
+                        _mm_or_si128(_mm_cmpeq_epi8(bytes, comma), _mm_cmpeq_epi8(bytes, newline))));
+                    result |= static_cast<uint64_t>(laneMask) << (lane * 16);
+                }
+                return result;
+#endif
+            }
+            uint64_t result = 0;
+            for (size_t i = 0; i < size; ++i) {
+                if (block[i] == ',' || block[i] == '\n') {
+                    result |= uint64_t{1} << i;
+                }
+            }
+            return result;
+        }
+    };
+
+    static bool parseUnsigned(const char* text, size_t length, unsigned& value) {
+        if (length == 0 || length > 10) return false;
+        uint64_t result = 0;
+        for (size_t i = 0; i < length; ++i) {
+            unsigned digit = static_cast<unsigned>(text[i] - '0');
+            if (digit > 9) return false;
+            result = result * 10 + digit;
+        }
+        if (result > numeric_limits<unsigned>::max()) return false;
+        value = static_cast<unsigned>(result);
+        return true;
+    }
+
+    // Accumulates the digits into an integer mantissa and applies the decimal scale
+    // with one correctly rounded division, which matches strtod for every amount of
+    // up to 15 significant digits. Longer or exponent-form amounts take the slow path.
+    static bool parseDecimal(const char* text, size_t length, double& value) {
+        static const double kPowersOfTen[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+                                              1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18};
+        const char* p = text;
+        const char* end = text + length;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p == '-';
+            ++p;
+        }
+        uint64_t mantissa = 0;
+        int significantDigits = 0;
+        int scale = 0;
+        bool seenPoint = false;
+        bool seenDigit = false;
+        for (; p < end; ++p) {
+            unsigned digit = static_cast<unsigned>(*p - '0');
+            if (digit <= 9) {
+                if (significantDigits == 18 || scale == 18) {
+                    return parseDecimalSlow(text, length, value);
+                }
+                mantissa = mantissa * 10 + digit;
+                significantDigits += mantissa != 0;
+                scale += seenPoint;
+                seenDigit = true;
+            } else if (*p == '.' && !seenPoint) {
+                seenPoint = true;
+            } else if (*p == 'e' || *p == 'E') {
+                return parseDecimalSlow(text, length, value);
+            } else {
+                return false;
+            }
+        }
+        if (!seenDigit) return false;
+        if (mantissa > (uint64_t{1} << 53)) {
+            return parseDecimalSlow(text, length, value);
+        }
+        double result = static_cast<double>(mantissa);
+        if (scale > 0) result /= kPowersOfTen[scale];
+        value = negative ? -result : result;
+        return true;
+    }
+
+    static bool parseDecimalSlow(const char* text, size_t length, double& value) {
+        char field[64];
+        if (length >= sizeof(field)) return false;
+        memcpy(field, text, length);
+        field[length] = '\0';
+        char* parsedEnd;
+        value = strtod(field, &parsedEnd);
+        return parsedEnd == field + length;
+    }
+
+    static vector<size_t> splitOnLines(const char* data, size_t size, unsigned chunks) {
+        vector<size_t> boundaries(chunks + 1, size);
+        boundaries[0] = 0;
+        for (unsigned i = 1; i < chunks; ++i) {
+            size_t offset = max(boundaries[i - 1], size * i / chunks);
+            const void* newline = offset < size ? memchr(data + offset, '\n', size - offset) : nullptr;
+            boundaries[i] = newline ? static_cast<const char*>(newline) - data + 1 : size;
+        }
+        return boundaries;
+    }
+
+    // Rows that do not parse, such as a header line, are skipped.
+    static void parseAccountCsv(const char* begin, const char* end, vector<pair<unsigned, double>>& rows) {
+        CsvScanner scanner(begin, end);
+        const char* fields[2];
+        size_t lengths[2];
+        while (size_t count = scanner.nextRecord(fields, lengths, 2)) {
+            unsigned accountId;
+            double balance;
+            if (count == 2 && parseUnsigned(fields[0], lengths[0], accountId) &&
+                parseDecimal(fields[1], lengths[1], balance)) {
+                rows.emplace_back(accountId, balance);
+            }
+        }
+    }
+
+    struct TransferRow {
+        unsigned fromAccountId;
+        unsigned toAccountId;
+        double amount;
+    };
+
+    static void parseTransferCsv(const char* begin, const char* end, vector<TransferRow>& rows) {
+        CsvScanner scanner(begin, end);
+        const char* fields[3];
+        size_t lengths[3];
+        while (size_t count = scanner.nextRecord(fields, lengths, 3)) {
+            TransferRow row;
+            if (count == 3 && parseUnsigned(fields[0], lengths[0], row.fromAccountId) &&
+                parseUnsigned(fields[1], lengths[1], row.toAccountId) &&
+                parseDecimal(fields[2], lengths[2], row.amount)) {
+                rows.push_back(row);
+            }
+        }
+    }
+
+    // Fixed set of preallocated output buffers that are formatted into under
+    // globalLock and handed to writev together once they are full.
+    class ReportBuffers {
+    public:
+        static constexpr size_t kBufferCount = 8;
+        static constexpr size_t kBufferSize = 1 << 20;
+
+        explicit ReportBuffers(int descriptor) : fd(descriptor) {
+            for (auto& buffer : buffers) {
+                buffer.reset(new char[kBufferSize]);
+            }
+        }
+
+        // Returns room for at least bytes characters, or nullptr once every buffer is full.
+        char* reserve(size_t bytes) {
+            if (kBufferSize - used[current] >= bytes) return buffers[current].get() + used[current];
+            if (current + 1 == kBufferCount) return nullptr;
+            ++current;
+            return buffers[current].get() + used[current];
+        }
+
+        void commit(char* end) {
+            used[current] = static_cast<size_t>(end - buffers[current].get());
+        }
+
+        size_t flush() {
+            iovec vectors[kBufferCount];
+            int count = 0;
+            size_t pending = 0;
+            for (size_t i = 0; i <= current; ++i) {
+                if (used[i] == 0) continue;
+                vectors[count].iov_base = buffers[i].get();
+                vectors[count].iov_len = used[i];
+                pending += used[i];
+                ++count;
+            }
+            size_t written = pending;
+            iovec* next = vectors;
+            while (pending > 0) {
+                ssize_t result = writev(fd, next, count);
+                if (result < 0) {
+                    if (errno == EINTR) continue;
+                    throw runtime_error("Report write failed: " + string(strerror(errno)));
+                }
+                pending -= static_cast<size_t>(result);
+                size_t advance = static_cast<size_t>(result);
+                while (count > 0 && advance >= next->iov_len) {
+                    advance -= next->iov_len;
+                    ++next;
+                    --count;
+                }
+                if (count > 0) {
+                    next->iov_base = static_cast<char*>(next->iov_base) + advance;
+                    next->iov_len -= advance;
+                }
+            }
+            fill(begin(used), end(used), 0);
+            current = 0;
+            return written;
+        }
+
+    private:
+        int fd;
+        unique_ptr<char[]> buffers[kBufferCount];
+        size_t used[kBufferCount] = {};
+        size_t current = 0;
+    };
+
+    static char* formatUnsigned(char* out, uint64_t value) {
+        static const char kDigitPairs[] =
+            "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+            "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+            "8081828384858687888990919293949596979899";
+        char digits[20];
+        char* p = digits + sizeof(digits);
+        while (value >= 100) {
+            unsigned pair = static_cast<unsigned>(value % 100) * 2;
+            value /= 100;
+            *--p = kDigitPairs[pair + 1];
+            *--p = kDigitPairs[pair];
+        }
+        if (value >= 10) {
+            unsigned pair = static_cast<unsigned>(value) * 2;
+            *--p = kDigitPairs[pair + 1];
+            *--p = kDigitPairs[pair];
+        } else {
+            *--p = static_cast<char>('0' + value);
+        }
+        size_t length = static_cast<size_t>(digits + sizeof(digits) - p);
+        memcpy(out, p, length);
+        return out + length;
+    }
+
+    // Formats an amount rounded to two decimal places.
+    static char* formatAmount(char* out, double amount) {
+        long long cents = llround(amount * 100.0);
+        if (cents < 0) {
+            *out++ = '-';
+            cents = -cents;
+        }
+        out = formatUnsigned(out, static_cast<uint64_t>(cents / 100));
+        unsigned fraction = static_cast<unsigned>(cents % 100);
+        *out++ = '.';
+        *out++ = static_cast<char>('0' + fraction / 10);
+        *out++ = static_cast<char>('0' + fraction % 10);
+        return out;
+    }
+
+    struct ScanGuard {
+        atomic<int>& scans;
+
+        explicit ScanGuard(atomic<int>& counter) : scans(counter) { ++scans; }
+        ~ScanGuard() { --scans; }
+
+        ScanGuard(const ScanGuard&) = delete;
+        ScanGuard& operator=(const ScanGuard&) = delete;
+    };
+
+    static bool sortedKeysIntersect(const vector<unsigned>& a, const vector<unsigned>& b) {
+        auto i = a.begin();
+        auto j = b.begin();
+        while (i != a.end() && j != b.end()) {
+            if (*i < *j) {
+                ++i;
+            } else if (*j < *i) {
+                ++j;
+            } else {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void pruneRecentCommits() {
+        unsigned horizon = activeSnapshots.empty() ? globalClock.load() : *activeSnapshots.begin();
+        while (!recentCommits.empty() && recentCommits.front().commitTimestamp <= horizon) {
+            recentCommits.pop_front();
+        }
+    }
+
+public:
+    FinancialTransactionSystem(unsigned numThreads = thread::hardware_concurrency())
+        : versionedData(decltype(versionedData)::allocator_type(memoryAccounting)), accountLookup(memoryAccounting),
+          rng(random_device{}()), workerCount(max(1u, numThreads)),
+          coldIndex(decltype(coldIndex)::allocator_type(memoryAccounting)) {
+        for (unsigned i = 0; i < numThreads; ++i) {
+            workerThreads.emplace_back(&FinancialTransactionSystem::workerFunction, this);
+        }
+        snapshotPublisher = thread(&FinancialTransactionSystem::snapshotPublisherFunction, this);
+    }
+
+    ~FinancialTransactionSystem() {
+        orderFlowStop.store(true);
+        for (auto& stage : orderFlowStages) {
+            stage.join();
+        }
+        if (orderFlowJournalFd >= 0) {
+            close(orderFlowJournalFd);
+        }
+        shutdownFlag.store(true);
+        {
+            lock_guard<mutex> lock(queueMutex);
+            queueCV.notify_all();
+            admissionCV.notify_all();
+        }
+        {
+            lock_guard<mutex> lock(snapshotMutex);
+            snapshotCV.notify_all();
+        }
+        {
+            lock_guard<mutex> lock(thawMutex);
+            thawCV.notify_all();
+        }
+        for (auto& thread : workerThreads) {
+            thread.join();
+        }
+        snapshotPublisher.join();
+        if (coldStoreFd >= 0) {
+            close(coldStoreFd);
+        }
+    }
+
+    void setIsolationLevel(IsolationLevel level) {
+        isolationLevel.store(level);
+    }
+
+    void setConflictResolution(ConflictResolution resolution) {
+        conflictResolution.store(resolution);
+    }
+
+    void setSnapshotInterval(chrono::microseconds interval) {
+        snapshotIntervalMicros.store(interval.count());
+    }
+
+    // Starts publishing balance snapshots for readBalanceWithin every interval.
+    // Until then readBalanceWithin reads each account directly.
+    void enableBalanceSnapshots(chrono::microseconds interval = chrono::microseconds(5000)) {
+        snapshotIntervalMicros.store(interval.count());
+        balanceSnapshotsEnabled.store(true);
+    }
+
+    void createAccount(unsigned accountId, double initialBalance) {
+        lock_guard<mutex> guard(globalLock);
+        recordForWriteLocked(accountId).append(0, initialBalance);
+    }
+
+    // Memory-maps path, parses it in parallel chunks and inserts every account in a
+    // single pass under one globalLock acquisition. Accounts that already exist are
+    // left unchanged; for duplicate IDs in the file the last row wins.
+    BulkLoadStats bulkLoadAccounts(const string& path, BulkFormat format,
+                                   unsigned numThreads = thread::hardware_concurrency()) {
+        auto loadStart = chrono::steady_clock::now();
+        MappedFile file(path);
+        const char* data = file.data();
+        size_t size = file.size();
+        numThreads = max(1u, numThreads);
+
+        vector<vector<pair<unsigned, double>>> chunkRows(numThreads);
+        vector<size_t> boundaries;
+        vector<thread> parsers;
+        if (format == BulkFormat::Binary) {
+            if (size % sizeof(BinaryAccountRecord) != 0) {
+                throw runtime_error("Truncated binary account file " + path);
+            }
+            size_t records = size / sizeof(BinaryAccountRecord);
+            for (unsigned i = 0; i < numThreads; ++i) {
+                size_t first = records * i / numThreads;
+                size_t last = records * (i + 1) / numThreads;
+                parsers.emplace_back([data, first, last, &rows = chunkRows[i]] {
+                    rows.reserve(last - first);
+                    for (size_t r = first; r < last; ++r) {
+                        BinaryAccountRecord record;
+                        memcpy(&record, data + r * sizeof(BinaryAccountRecord), sizeof(record));
+                        rows.emplace_back(record.accountId, record.balance);
+                    }
+                });
+            }
+        } else {
+            boundaries = splitOnLines(data, size, numThreads);
+            for (unsigned i = 0; i < numThreads; ++i) {
+                parsers.emplace_back([data, &boundaries, i, &rows = chunkRows[i]] {
+                    parseAccountCsv(data + boundaries[i], data + boundaries[i + 1], rows);
+                });
+            }
+        }
+        for (auto& parser : parsers) {
+            parser.join();
+        }
+
+        vector<pair<unsigned, double>> rows;
+        size_t totalRows = 0;
+        for (const auto& chunk : chunkRows) totalRows += chunk.size();
+        rows.reserve(totalRows);
+        for (auto& chunk : chunkRows) {
+            rows.insert(rows.end(), chunk.begin(), chunk.end());
+            vector<pair<unsigned, double>>().swap(chunk);
+        }
+        if (!is_sorted(rows.begin(), rows.end(),
+                       [](const auto& a, const auto& b) { return a.first < b.first; })) {
+            stable_sort(rows.begin(), rows.end(),
+                        [](const auto& a, const auto& b) { return a.first < b.first; });
+        }
+
+        decltype(versionedData) loaded(versionedData.get_allocator());
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (i + 1 < rows.size() && rows[i + 1].first == rows[i].first) {
+                continue;
+            }
+            loaded.emplace_hint(loaded.end(), piecewise_construct, forward_as_tuple(rows[i].first),
+                                forward_as_tuple(memoryAccounting, 0u, rows[i].second));
+        }
+        {
+            lock_guard<mutex> guard(globalLock);
+            for (const auto& entry : coldIndex) {
+                loaded.erase(entry.first);
+            }
+            accountLookup.reserve(loaded.size());
+            if (versionedData.empty()) {
+                versionedData.swap(loaded);
+                for (auto& entry : versionedData) {
+                    accountLookup.insert(entry.first, &entry.second);
+                }
+            } else {
+                while (!loaded.empty()) {
+                    auto result = versionedData.insert(loaded.extract(loaded.begin()));
+                    if (result.inserted) {
+                        accountLookup.insert(result.position->first, &result.position->second);
+                    }
+                }
+            }
+        }
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - loadStart).count();
+        return BulkLoadStats{totalRows, seconds, seconds > 0 ? totalRows / seconds : 0.0};
+    }
+
+    // Enables eviction of dormant accounts to an append-only file at path. The
+    // presence filter is sized for expectedColdAccounts at roughly 1% false positives.
+    void enableColdStore(const string& path, size_t expectedColdAccounts) {
+        lock_guard<mutex> guard(globalLock);
+        lock_guard<mutex> coldGuard(coldMutex);
+        if (coldStoreFd >= 0) {
+            throw runtime_error("Cold store already enabled");
+        }
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw runtime_error("Cannot open " + path);
+        }
+        size_t bits = 64;
+        while (bits < expectedColdAccounts * 10) {
+            bits <<= 1;
+        }
+        coldFilter.reset(new atomic<uint64_t>[bits / 64]);
+        for (size_t i = 0; i < bits / 64; ++i) {
+            coldFilter[i].store(0, memory_order_relaxed);
+        }
+        coldFilterBits.store(bits);
+        coldStoreFd.store(fd);
+    }
+
+    // Moves accounts whose newest version is at least idleCommits commits old to
+    // the cold store. They are hydrated transparently on their next access.
+    // globalLock is held for at most kAccountsPerLock accounts visited at a time;
+    // candidates copied under an earlier hold are revalidated before eviction.
+    size_t evictDormantAccounts(unsigned idleCommits, size_t maxAccounts = numeric_limits<size_t>::max()) {
+        static constexpr size_t kEvictionBatch = 65536;
+        static constexpr size_t kAccountsPerLock = 4096;
+        if (coldStoreFd < 0) {
+            throw runtime_error("Cold store not enabled");
+        }
+        size_t evicted = 0;
+        unsigned nextAccountId = 0;
+        bool done = false;
+        bool suspended = false;
+        while (!done && !suspended && evicted < maxAccounts) {
+            vector<pair<unsigned, vector<AccountRecord::Version>>> candidates;
+            size_t wanted = min(kEvictionBatch, maxAccounts - evicted);
+            while (!done && candidates.size() < wanted) {
+                lock_guard<mutex> guard(globalLock);
+                if (activeScans.load() > 0) {
+                    suspended = true;
+                    break;
+                }
+                unsigned now = globalClock.load();
+                auto it = versionedData.lower_bound(nextAccountId);
+                for (size_t visited = 0; it != versionedData.end() && visited < kAccountsPerLock &&
+                                         candidates.size() < wanted; ++it, ++visited) {
+                    const AccountRecord& account = it->second;
+                    if (!account.empty() && now - account.newestTimestamp() >= idleCommits &&
+                        (pinnedAccounts.empty() || pinnedAccounts.count(it->first) == 0)) {
+                        candidates.emplace_back(it->first, account.versions());
+                    }
+                }
+                if (it == versionedData.end()) {
+                    done = true;
+                } else {
+                    nextAccountId = it->first;
+                }
+            }
+            if (suspended || candidates.empty()) continue;
+
+            vector<char> record;
+            vector<ColdLocation> locations;
+            locations.reserve(candidates.size());
+            for (const auto& candidate : candidates) {
+                const auto& versions = candidate.second;
+                locations.push_back(ColdLocation{record.size(), static_cast<uint32_t>(versions.size()),
+                                                 versions.back().first, versions.back().second});
+                ColdRecordHeader header{candidate.first, static_cast<uint32_t>(versions.size())};
+                const char* headerBytes = reinterpret_cast<const char*>(&header);
+                record.insert(record.end(), headerBytes, headerBytes + sizeof(header));
+                for (const auto& version : versions) {
+                    ColdVersion cold{version.first, 0, version.second};
+                    const char* versionBytes = reinterpret_cast<const char*>(&cold);
+                    record.insert(record.end(), versionBytes, versionBytes + sizeof(cold));
+                }
+            }
+
+            uint64_t base;
+            {
+                lock_guard<mutex> coldGuard(coldMutex);
+                base = coldStoreEnd;
+                coldStoreEnd += record.size();
+            }
+            writeColdStore(record.data(), record.size(), base);
+
+            lock_guard<mutex> guard(globalLock);
+            lock_guard<mutex> coldGuard(coldMutex);
+            if (activeScans.load() > 0) break;
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                auto it = versionedData.find(candidates[i].first);
+                if (it == versionedData.end() || it->second.size() != candidates[i].second.size() ||
+                    it->second.newestTimestamp() != candidates[i].second.back().first ||
+                    pinnedAccounts.count(it->first) != 0) {
+                    continue;  // Written or pinned since it was copied; the record is left unreferenced
+                }
+                ColdLocation location = locations[i];
+                location.offset += base;
+                coldIndex[it->first] = location;
+                markCold(it->first);
+                accountLookup.erase(it->first);
+                versionedData.erase(it);
+                ++evicted;
+            }
+        }
+        return evicted;
+    }
+
+    size_t residentAccounts() {
+        lock_guard<mutex> guard(globalLock);
+        return versionedData.size();
+    }
+
+    // Stable reference to a resolved account. While resolved, the account is pinned
+    // in memory and is never evicted, so transactions can access its versions
+    // directly. Handles must not be used after releaseAccount.
+    class AccountHandle {
+    public:
+        AccountHandle() = default;
+
+        unsigned accountId() const { return id; }
+        bool valid() const { return record != nullptr; }
+
+    private:
+        friend class FinancialTransactionSystem;
+
+        unsigned id = 0;
+        AccountRecord* record = nullptr;
+    };
+
+    // Resolves accountId once, hydrating it if it was evicted, and pins it until
+    // releaseAccount. Resolving an account again adds another pin.
+    AccountHandle resolveAccount(unsigned accountId) {
+        unique_lock<mutex> guard(globalLock);
+        AccountRecord* record = accountLookup.find(accountId);
+        while (record == nullptr) {
+            guard.unlock();
+            if (!hydrateAccount(accountId)) {
+                throw out_of_range("Account not found");
+            }
+            guard.lock();
+            record = accountLookup.find(accountId);
+        }
+        ++pinnedAccounts[accountId];
+        AccountHandle handle;
+        handle.id = accountId;
+        handle.record = record;
+        return handle;
+    }
+
+    void releaseAccount(AccountHandle& handle) {
+        if (!handle.valid()) return;
+        lock_guard<mutex> guard(globalLock);
+        auto it = pinnedAccounts.find(handle.id);
+        if (it != pinnedAccounts.end() && --it->second == 0) {
+            pinnedAccounts.erase(it);
+        }
+        handle.record = nullptr;
+    }
+
+    class Transaction {
+    private:
+        FinancialTransactionSystem& parentSystem;
+        // record is set when the account was accessed through a pinned AccountHandle,
+        // letting validation and installation skip the account lookup.
+        struct ReadEntry {
+            double value;
+            unsigned version;
+            const AccountRecord* record;
+        };
+
+        struct WriteEntry {
+            double value;
+            AccountRecord* record;
+        };
+
+        map<unsigned, ReadEntry, less<unsigned>,
+            TrackingAllocator<pair<const unsigned, ReadEntry>, MemorySubsystem::ReadWriteSets>> readSet;
+        map<unsigned, WriteEntry, less<unsigned>,
+            TrackingAllocator<pair<const unsigned, WriteEntry>, MemorySubsystem::ReadWriteSets>> writeSet;
+        // Commutative increments, applied to the newest balance at commit without validation.
+        map<unsigned, double, less<unsigned>,
+            TrackingAllocator<pair<const unsigned, double>, MemorySubsystem::ReadWriteSets>> deltaSet;
+        unsigned startTimestamp;
+        unsigned endTimestamp;
+        IsolationLevel isolationLevel;
+        bool snapshotRegistered = false;
+        int priority;
+        uint64_t serial;
+        bool priorityWound;
+        bool frozenOut = false;
+        unsigned frozenInstrument = 0;
+        vector<unsigned> claimedAccounts;
+        vector<ExposureDelta> exposureDeltas;
+
+        void claimAccount(unsigned accountId) {
+            lock_guard<mutex> lock(parentSystem.claimsMutex);
+            auto result = parentSystem.accountClaims.emplace(accountId, AccountClaim{priority, serial});
+            AccountClaim& claim = result.first->second;
+            if (result.second || claim.priority < priority) {
+                claim = AccountClaim{priority, serial};  // Wounds any lower-priority claimant
+                claimedAccounts.push_back(accountId);
+            }
+        }
+
+        void releaseClaims() {
+            if (claimedAccounts.empty()) return;
+            lock_guard<mutex> lock(parentSystem.claimsMutex);
+            for (unsigned accountId : claimedAccounts) {
+                auto it = parentSystem.accountClaims.find(accountId);
+                if (it != parentSystem.accountClaims.end() && it->second.owner == serial) {
+                    parentSystem.accountClaims.erase(it);
+                }
+            }
+            claimedAccounts.clear();
+        }
+
+        // Requires globalLock.
+        double readVersionLocked(unsigned accountId, const AccountRecord& account, const AccountRecord* pinned) {
+            AccountRecord::Version version;
+            if (!account.versionAt(startTimestamp, version)) {
+                throw runtime_error("No valid version found for account " + to_string(accountId));
+            }
+            readSet[accountId] = ReadEntry{version.second, version.first, pinned};
+            return version.second;
+        }
+
+        // Requires globalLock. Sets frozenInstrument to the first frozen instrument written.
+        bool writesFrozenInstrument() {
+            for (const auto& entry : writeSet) {
+                frozenInstrument = entry.first / kInstrumentAccountStride;
+                if (parentSystem.frozenInstruments.count(frozenInstrument)) return true;
+            }
+            for (const auto& entry : deltaSet) {
+                frozenInstrument = entry.first / kInstrumentAccountStride;
+                if (parentSystem.frozenInstruments.count(frozenInstrument)) return true;
+            }
+            return false;
+        }
+
+        // Requires globalLock.
+        bool woundedByHigherPriority() const {
+            lock_guard<mutex> lock(parentSystem.claimsMutex);
+            for (const auto& entry : writeSet) {
+                auto it = parentSystem.accountClaims.find(entry.first);
+                if (it != parentSystem.accountClaims.end() && it->second.owner != serial &&
+                    it->second.priority > priority) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool hasWriteWriteConflict() const {
+            for (const auto& entry : writeSet) {
+                const AccountRecord* account = entry.second.record;
+                if (account == nullptr) {
+                    account = parentSystem.accountLookup.find(entry.first);
+                    if (account == nullptr) {
+                        if (parentSystem.coldNewestTimestampLocked(entry.first) > startTimestamp) {
+                            return true;
+                        }
+                        continue;
+                    }
+                }
+                if (account->newestTimestamp() > startTimestamp) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool hasReadConflict() const {
+            for (const auto& entry : readSet) {
+                unsigned accountId = entry.first;
+                unsigned readVersion = entry.second.version;
+                const AccountRecord* account = entry.second.record;
+                if (account == nullptr) {
+                    account = parentSystem.accountLookup.find(accountId);
+                    if (account == nullptr) {
+                        if (parentSystem.coldNewestTimestampLocked(accountId) > readVersion) {
+                            return true;
+                        }
+                        continue;
+                    }
+                }
+                // Every installed version precedes endTimestamp, so only the newest matters.
+                if (account->newestTimestamp() > readVersion) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Aborts only when this transaction would complete a dangerous structure
+        // Tin -rw-> Tpivot -rw-> Tout in which Tout committed first.
+        bool hasDangerousStructure(const vector<unsigned>& readKeys, const vector<unsigned>& writeKeys,
+                                   bool& inConflict, bool& outConflict) const {
+            for (const auto& committed : parentSystem.recentCommits) {
+                if (committed.commitTimestamp <= startTimestamp) {
+                    continue;
+                }
+                if (sortedKeysIntersect(readKeys, committed.writeKeys)) {
+                    outConflict = true;
+                    if (committed.outConflict) {
+                        return true;
+                    }
+                }
+                if (sortedKeysIntersect(writeKeys, committed.readKeys)) {
+                    inConflict = true;
+                }
+            }
+            return inConflict && outConflict;
+        }
+
+    public:
+        Transaction(FinancialTransactionSystem& system, int transactionPriority = 0)
+            : parentSystem(system), readSet(decltype(readSet)::allocator_type(system.memoryAccounting)),
+              writeSet(decltype(writeSet)::allocator_type(system.memoryAccounting)),
+              deltaSet(decltype(deltaSet)::allocator_type(system.memoryAccounting)),
+              startTimestamp(system.globalClock.load()),
+              isolationLevel(system.isolationLevel.load()), priority(transactionPriority),
+              serial(system.nextTransactionSerial++),
+              priorityWound(system.conflictResolution.load() == ConflictResolution::PriorityWound) {
+            if (isolationLevel == IsolationLevel::SerializableSnapshot) {
+                lock_guard<mutex> guard(parentSystem.globalLock);
+                startTimestamp = parentSystem.globalClock.load();
+                parentSystem.activeSnapshots.insert(startTimestamp);
+                snapshotRegistered = true;
+            }
+        }
+
+        ~Transaction() {
+            releaseClaims();
+            if (snapshotRegistered) {
+                lock_guard<mutex> guard(parentSystem.globalLock);
+                parentSystem.activeSnapshots.erase(parentSystem.activeSnapshots.find(startTimestamp));
+            }
+        }
+
+        Transaction(const Transaction&) = delete;
+        Transaction& operator=(const Transaction&) = delete;
+
+        // True when the last commit was refused because it writes a position frozen
+        // by a corporate action in progress; retry after waitForCorporateActions.
+        bool blockedByCorporateAction() const { return frozenOut; }
+        unsigned blockingInstrument() const { return frozenInstrument; }
+
+        double readBalance(unsigned accountId) {
+            auto written = writeSet.find(accountId);
+            if (written != writeSet.end()) {
+                return written->second.value;
+            }
+            if (!deltaSet.empty()) {
+                auto delta = deltaSet.find(accountId);
+                if (delta != deltaSet.end()) {
+                    double pending = delta->second;
+                    deltaSet.erase(delta);
+                    double balance = readBalance(accountId) + pending;
+                    updateBalance(accountId, balance);
+                    return balance;
+                }
+            }
+
+            unique_lock<mutex> guard(parentSystem.globalLock);
+            const AccountRecord* account = parentSystem.accountLookup.find(accountId);
+            while (account == nullptr) {
+                guard.unlock();
+                if (!parentSystem.hydrateAccount(accountId)) {
+                    throw out_of_range("Account not found");
+                }
+                guard.lock();
+                account = parentSystem.accountLookup.find(accountId);
+            }
+
+            return readVersionLocked(accountId, *account, nullptr);
+        }
+
+        double readBalance(const AccountHandle& account) {
+            auto written = writeSet.find(account.id);
+            if (written != writeSet.end()) {
+                return written->second.value;
+            }
+            if (!deltaSet.empty()) {
+                auto delta = deltaSet.find(account.id);
+                if (delta != deltaSet.end()) {
+                    double pending = delta->second;
+                    deltaSet.erase(delta);
+                    double balance = readBalance(account) + pending;
+                    updateBalance(account, balance);
+                    return balance;
+                }
+            }
+            // The clock is published only after a commit installs its versions, so a
+            // newest version at or below startTimestamp is the snapshot's version.
+            // Older versions are walked without globalLock under a read guard.
+            AccountRecord::Version version;
+            if (!account.record->readNewest(version) || version.first > startTimestamp) {
+                VersionReadGuard guard(parentSystem.versionReaders);
+                if (!account.record->versionAt(startTimestamp, version)) {
+                    throw runtime_error("No valid version found for account " + to_string(account.id));
+                }
+            }
+            readSet[account.id] = ReadEntry{version.second, version.first, account.record};
+            return version.second;
+        }
+
+        void updateBalance(unsigned accountId, double newBalance) {
+            auto written = writeSet.find(accountId);
+            if (written != writeSet.end()) {
+                written->second.value = newBalance;
+                return;
+            }
+            if (priorityWound) {
+                claimAccount(accountId);
+            }
+            deltaSet.erase(accountId);
+            writeSet.emplace(accountId, WriteEntry{newBalance, nullptr});
+        }
+
+        // Adds delta to the balance current at commit time. The account is neither
+        // read nor validated, so concurrent increments to one account, such as fee
+        // credits, never conflict. Reading the account later in the transaction
+        // turns the increment into an ordinary validated write.
+        void addToBalance(unsigned accountId, double delta) {
+            auto written = writeSet.find(accountId);
+            if (written != writeSet.end()) {
+                written->second.value += delta;
+                return;
+            }
+            deltaSet[accountId] += delta;
+        }
+
+        void updateBalance(const AccountHandle& account, double newBalance) {
+            auto written = writeSet.find(account.id);
+            if (written != writeSet.end()) {
+                written->second.value = newBalance;
+                written->second.record = account.record;
+                return;
+            }
+            if (priorityWound) {
+                claimAccount(account.id);
+            }
+            deltaSet.erase(account.id);
+            writeSet.emplace(account.id, WriteEntry{newBalance, account.record});
+        }
+
+        // Applies legs sorted by account ID without duplicates, as built by
+        // resolveLegs. On a fresh transaction every account is read under one
+        // globalLock acquisition and the sets are filled in key order.
+        void applyLegs(const vector<ResolvedLeg>& legs) {
+            if (!readSet.empty() || !writeSet.empty() || !deltaSet.empty()) {
+                for (const auto& leg : legs) {
+                    double balance = readBalance(leg.accountId) + leg.amount;
+                    if (leg.nonNegative && balance < 0.0) {
+                        throw runtime_error("Leg constraint violated for account " + to_string(leg.accountId));
+                    }
+                    updateBalance(leg.accountId, balance);
+                }
+                return;
+            }
+
+            vector<double> balances(legs.size());
+            {
+                unique_lock<mutex> guard(parentSystem.globalLock);
+                for (size_t i = 0; i < legs.size(); ++i) {
+                    unsigned accountId = legs[i].accountId;
+                    const AccountRecord* account = parentSystem.accountLookup.find(accountId);
+                    while (account == nullptr) {
+                        guard.unlock();
+                        if (!parentSystem.hydrateAccount(accountId)) {
+                            throw out_of_range("Account not found");
+                        }
+                        guard.lock();
+                        account = parentSystem.accountLookup.find(accountId);
+                    }
+                    AccountRecord::Version version;
+                    if (!account->versionAt(startTimestamp, version)) {
+                        throw runtime_error("No valid version found for account " + to_string(accountId));
+                    }
+                    readSet.emplace_hint(readSet.end(), accountId, ReadEntry{version.second, version.first, nullptr});
+                    balances[i] = version.second + legs[i].amount;
+                }
+            }
+            for (size_t i = 0; i < legs.size(); ++i) {
+                if (legs[i].nonNegative && balances[i] < 0.0) {
+                    throw runtime_error("Leg constraint violated for account " + to_string(legs[i].accountId));
+                }
+            }
+            for (size_t i = 0; i < legs.size(); ++i) {
+                if (priorityWound) {
+                    claimAccount(legs[i].accountId);
+                }
+                writeSet.emplace_hint(writeSet.end(), legs[i].accountId, WriteEntry{balances[i], nullptr});
+            }
+        }
+
+        // Counts toward the exposure matrix once the transaction commits.
+        void recordExposure(unsigned buyerAccountId, unsigned sellerAccountId, double notional) {
+            double net = sellerAccountId < buyerAccountId ? notional : -notional;
+            exposureDeltas.push_back(
+                ExposureDelta{ExposureMatrix::pairKey(buyerAccountId, sellerAccountId), notional, net});
+        }
+
+        bool commit() {
+            bool committed;
+            {
+                lock_guard<mutex> guard(parentSystem.globalLock);
+                committed = commitLocked();
+            }
+            if (committed && !exposureDeltas.empty()) {
+                parentSystem.exposureMatrix.record(exposureDeltas);
+            }
+            return committed;
+        }
+
+    private:
+        bool commitLocked() {
+            endTimestamp = parentSystem.globalClock.load() + 1;
+
+            if (parentSystem.frozenInstrumentCount.load(memory_order_relaxed) > 0 && writesFrozenInstrument()) {
+                frozenOut = true;
+                return false;
+            }
+
+            if (priorityWound && woundedByHigherPriority()) {
+                return false;
+            }
+
+            if (isolationLevel == IsolationLevel::Serializable) {
+                if (hasReadConflict()) {
+                    return false;  // Conflict detected
+                }
+            } else if (hasWriteWriteConflict()) {
+                return false;  // Conflict detected
+            }
+
+            if (isolationLevel == IsolationLevel::SerializableSnapshot) {
+                vector<unsigned> readKeys;
+                vector<unsigned> writeKeys;
+                readKeys.reserve(readSet.size());
+                writeKeys.reserve(writeSet.size());
+                for (const auto& entry : readSet) readKeys.push_back(entry.first);
+                for (const auto& entry : writeSet) writeKeys.push_back(entry.first);
+                if (!deltaSet.empty()) {
+                    auto middle = writeKeys.size();
+                    for (const auto& entry : deltaSet) writeKeys.push_back(entry.first);
+                    inplace_merge(writeKeys.begin(), writeKeys.begin() + static_cast<ptrdiff_t>(middle), writeKeys.end());
+                }
+
+                bool inConflict = false;
+                bool outConflict = false;
+                if (hasDangerousStructure(readKeys, writeKeys, inConflict, outConflict)) {
+                    return false;
+                }
+
+                for (auto& committed : parentSystem.recentCommits) {
+                    if (committed.commitTimestamp <= startTimestamp) {
+                        continue;
+                    }
+                    if (sortedKeysIntersect(readKeys, committed.writeKeys)) {
+                        committed.inConflict = true;
+                    }
+                    if (sortedKeysIntersect(writeKeys, committed.readKeys)) {
+                        committed.outConflict = true;
+                    }
+                }
+                parentSystem.recentCommits.push_back(CommittedTransaction{
+                    startTimestamp, endTimestamp, move(readKeys), move(writeKeys), inConflict, outConflict});
+                parentSystem.pruneRecentCommits();
+            }
+
+            for (const auto& entry : writeSet) {
+                AccountRecord& account = entry.second.record ? *entry.second.record
+                                                             : parentSystem.recordForWriteLocked(entry.first);
+                account.append(endTimestamp, entry.second.value);
+            }
+            for (const auto& entry : deltaSet) {
+                AccountRecord& account = parentSystem.recordForWriteLocked(entry.first);
+                account.append(endTimestamp, (account.empty() ? 0.0 : account.newestBalance()) + entry.second);
+            }
+            parentSystem.globalClock.store(endTimestamp);
+
+            return true;
+        }
+    };
+
+    void scheduleTransaction(const function<void(Transaction&)>& transactionLogic, int priority, const string& description) {
+        scheduleTransaction(transactionLogic, priority, description, TransactionOptions());
+    }
+
+    // Work whose deadline has passed or whose token was cancelled is dropped before
+    // dispatch and between retry attempts. Returns false, without queueing, when
+    // options.clientId has exhausted its rate limit.
+    bool scheduleTransaction(const function<void(Transaction&)>& transactionLogic, int priority,
+                             const string& description, const TransactionOptions& options) {
+        if (options.clientId != 0 && !rateLimiter.tryAcquire(options.clientId, 1)) {
+            rateLimitedSubmissions.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        unique_lock<mutex> lock(queueMutex);
+        admissionCV.wait(lock, [this] { return !admissionThrottled.load() || shutdownFlag.load(); });
+        transactionQueue.emplace(transactionLogic, priority, description, options);
+        memoryAccounting.add(MemorySubsystem::TransactionQueue, queuedBytes(description));
+        activeTransactions++;
+        queueCV.notify_one();
+        return true;
+    }
+
+    bool executeTrade(unsigned buyerAccountId, unsigned sellerAccountId, double amount,
+                      const TransactionOptions& options = TransactionOptions()) {
+        return executeTrade(buyerAccountId, sellerAccountId, kAnyInstrument, amount, options);
+    }
+
+    // With a fee schedule loaded, the buyer also pays the fee for its tier, the
+    // instrument and the notional, which is credited to the fee account.
+    bool executeTrade(unsigned buyerAccountId, unsigned sellerAccountId, unsigned instrument, double amount,
+                      const TransactionOptions& options = TransactionOptions()) {
+        return scheduleTransaction([this, buyerAccountId, sellerAccountId, instrument, amount](Transaction& tx) {
+            auto schedule = atomic_load(&feeSchedule);
+            if (!applyTrade(tx, schedule.get(), buyerAccountId, sellerAccountId, instrument, amount)) {
+                throw runtime_error("Insufficient funds for trade");
+            }
+        }, 10, "Stock trade", withDeclaredAccounts(options, {buyerAccountId, sellerAccountId}));
+    }
+
+    // Freezes commits that write positions in action.instrument, values every
+    // position as of the freeze in parallel partitions, and installs the new
+    // positions and cash credits under one globalLock acquisition at a single
+    // commit timestamp. Cash credits are added to the newest cash balance, which
+    // stays tradable throughout. Eviction and GC are suspended meanwhile.
+    CorporateActionStats applyCorporateAction(const CorporateAction& action,
+                                              unsigned numThreads = thread::hardware_concurrency()) {
+        static constexpr size_t kAccountsPerLock = 4096;
+        if (action.instrument == 0) {
+            throw invalid_argument("Instrument 0 is the cash account range");
+        }
+        auto actionStart = chrono::steady_clock::now();
+        numThreads = max(1u, numThreads);
+        uint64_t firstAccountId = uint64_t{action.instrument} * kInstrumentAccountStride;
+        uint64_t endAccountId = firstAccountId + kInstrumentAccountStride;
+        if (endAccountId - 1 > numeric_limits<unsigned>::max()) {
+            throw invalid_argument("Instrument out of range");
+        }
+
+        lock_guard<mutex> actionGuard(corporateActionMutex);
+        ScanGuard scan(activeScans);
+        struct Holding {
+            unsigned accountId;
+            const AccountRecord* record;   // nullptr for an evicted account
+            double position;
+        };
+        vector<Holding> holdings;
+        unsigned frozenAt;
+        {
+            lock_guard<mutex> guard(globalLock);
+            frozenInstruments.insert(action.instrument);
+            frozenInstrumentCount.store(frozenInstruments.size());
+            frozenAt = globalClock.load();
+            for (const auto& entry : coldIndex) {
+                if (entry.first >= firstAccountId && entry.first < endAccountId) {
+                    holdings.push_back(Holding{entry.first, nullptr, entry.second.newestBalance});
+                }
+            }
+        }
+        struct Thaw {
+            FinancialTransactionSystem& system;
+            unsigned instrument;
+            ~Thaw() {
+                vector<TransactionInfo> parked;
+                {
+                    lock_guard<mutex> guard(system.globalLock);
+                    system.frozenInstruments.erase(instrument);
+                    system.frozenInstrumentCount.store(system.frozenInstruments.size());
+                    auto it = system.parkedTransactions.find(instrument);
+                    if (it != system.parkedTransactions.end()) {
+                        parked = move(it->second);
+                        system.parkedTransactions.erase(it);
+                    }
+                }
+                if (!parked.empty()) {
+                    lock_guard<mutex> lock(system.queueMutex);
+                    for (auto& info : parked) {
+                        system.memoryAccounting.add(MemorySubsystem::TransactionQueue, queuedBytes(info.description));
+                        system.transactionQueue.emplace(move(info));
+                    }
+                    system.queueCV.notify_all();
+                }
+                lock_guard<mutex> lock(system.thawMutex);
+                system.thawCV.notify_all();
+            }
+        } thaw{*this, action.instrument};
+
+        for (uint64_t nextId = firstAccountId; nextId < endAccountId;) {
+            lock_guard<mutex> guard(globalLock);
+            auto it = versionedData.lower_bound(static_cast<unsigned>(nextId));
+            size_t batch = 0;
+            for (; it != versionedData.end() && it->first < endAccountId && batch < kAccountsPerLock; ++it, ++batch) {
+                holdings.push_back(Holding{it->first, &it->second, 0.0});
+            }
+            nextId = it == versionedData.end() || it->first >= endAccountId ? endAccountId : it->first;
+        }
+        // An evicted holder hydrated since the freeze is listed twice; keep the resident copy.
+        sort(holdings.begin(), holdings.end(), [](const Holding& a, const Holding& b) {
+            return a.accountId != b.accountId ? a.accountId < b.accountId : a.record != nullptr && b.record == nullptr;
+        });
+        holdings.erase(unique(holdings.begin(), holdings.end(),
+                              [](const Holding& a, const Holding& b) { return a.accountId == b.accountId; }),
+                       holdings.end());
+
+        vector<thread> workers;
+        for (unsigned i = 0; i < numThreads; ++i) {
+            size_t first = holdings.size() * i / numThreads;
+            size_t last = holdings.size() * (i + 1) / numThreads;
+            workers.emplace_back([this, &holdings, first, last, frozenAt] {
+                VersionReadGuard readGuard(versionReaders);
+                for (size_t h = first; h < last; ++h) {
+                    AccountRecord::Version version;
+                    if (holdings[h].record != nullptr) {
+                        holdings[h].position = holdings[h].record->versionAt(frozenAt, version) ? version.second : 0.0;
+                    }
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        CorporateActionStats stats{0, 0, 0.0};
+        {
+            lock_guard<mutex> guard(globalLock);
+            stats.effectiveTimestamp = globalClock.load() + 1;
+            for (const auto& holding : holdings) {
+                if (holding.position == 0.0) continue;
+                AccountRecord& position = holding.record ? *const_cast<AccountRecord*>(holding.record)
+                                                         : recordForWriteLocked(holding.accountId);
+                position.append(stats.effectiveTimestamp, holding.position * action.positionFactor);
+                if (action.cashPerUnit != 0.0) {
+                    AccountRecord& cash = recordForWriteLocked(holding.accountId - action.instrument * kInstrumentAccountStride);
+                    cash.append(stats.effectiveTimestamp,
+                                (cash.empty() ? 0.0 : cash.newestBalance()) + holding.position * action.cashPerUnit);
+                }
+                ++stats.holders;
+            }
+            globalClock.store(stats.effectiveTimestamp);
+        }
+        stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - actionStart).count();
+        return stats;
+    }
+
+    void waitForCorporateActions() {
+        unique_lock<mutex> lock(thawMutex);
+        thawCV.wait(lock, [this] { return frozenInstrumentCount.load() == 0 || shutdownFlag.load(); });
+    }
+
+    // handler runs on the thread that merges, normally the snapshot publisher, once
+    // for each pair whose gross or absolute net exposure reaches its limit.
+    void setExposureAlerts(double grossLimit, double netLimit, function<void(const ExposureAlert&)> handler) {
+        lock_guard<mutex> lock(exposureAlertMutex);
+        exposureGrossLimit = grossLimit;
+        exposureNetLimit = netLimit;
+        exposureAlertHandler = move(handler);
+    }
+
+    // Folds the per-CPU deltas of committed trades into the matrix. The snapshot
+    // publisher does this every interval; queries see the last merge.
+    void mergeExposures() {
+        double grossLimit;
+        double netLimit;
+        function<void(const ExposureAlert&)> handler;
+        {
+            lock_guard<mutex> lock(exposureAlertMutex);
+            grossLimit = exposureGrossLimit;
+            netLimit = exposureNetLimit;
+            handler = exposureAlertHandler;
+        }
+        vector<ExposureAlert> alerts = exposureMatrix.merge(grossLimit, netLimit);
+        if (handler) {
+            for (const auto& alert : alerts) {
+                handler(alert);
+            }
+        }
+    }
+
+    vector<CounterpartyExposure> exposureRow(unsigned accountId) const {
+        return exposureMatrix.row(accountId);
+    }
+
+    CounterpartyExposure exposureBetween(unsigned accountId, unsigned counterparty) const {
+        return exposureMatrix.between(accountId, counterparty);
+    }
+
+    // Compiles schedule and publishes it for trades that start afterwards; trades
+    // already running keep the schedule they loaded.
+    void loadFeeSchedule(const FeeSchedule& schedule) {
+        atomic_store(&feeSchedule, shared_ptr<const CompiledFeeSchedule>(make_shared<CompiledFeeSchedule>(schedule)));
+    }
+
+    void clearFeeSchedule() {
+        atomic_store(&feeSchedule, shared_ptr<const CompiledFeeSchedule>());
+    }
+
+    double quoteFee(unsigned accountId, unsigned instrument, double notional) const {
+        auto schedule = atomic_load(&feeSchedule);
+        return schedule ? schedule->fee(accountId, instrument, notional) : 0.0;
+    }
+
+    bool transferFunds(unsigned fromAccountId, unsigned toAccountId, double amount,
+                       const TransactionOptions& options = TransactionOptions()) {
+        return scheduleTransaction(makeTransferLogic(fromAccountId, toAccountId, amount), 5, "Bank transfer",
+                                   withDeclaredAccounts(options, {fromAccountId, toAccountId}));
+    }
+
+    // Parses "fromAccountId,toAccountId,amount" rows in parallel and enqueues every
+    // transfer under a single queueMutex acquisition, preserving file order. With a
+    // clientId the whole file is charged against that client's rate limit at once.
+    BulkLoadStats submitTransfersFromFile(const string& path, unsigned numThreads = thread::hardware_concurrency(),
+                                          unsigned clientId = 0) {
+        auto submitStart = chrono::steady_clock::now();
+        MappedFile file(path);
+        numThreads = max(1u, numThreads);
+
+        vector<size_t> boundaries = splitOnLines(file.data(), file.size(), numThreads);
+        vector<vector<TransferRow>> chunkRows(numThreads);
+        vector<thread> parsers;
+        for (unsigned i = 0; i < numThreads; ++i) {
+            parsers.emplace_back([&file, &boundaries, i, &rows = chunkRows[i]] {
+                parseTransferCsv(file.data() + boundaries[i], file.data() + boundaries[i + 1], rows);
+            });
+        }
+        for (auto& parser : parsers) {
+            parser.join();
+        }
+
+        size_t totalRows = 0;
+        for (const auto& rows : chunkRows) totalRows += rows.size();
+        if (clientId != 0 && !rateLimiter.tryAcquire(clientId, totalRows)) {
+            rateLimitedSubmissions.fetch_add(1, memory_order_relaxed);
+            throw runtime_error("Rate limit exceeded for client " + to_string(clientId));
+        }
+        {
+            unique_lock<mutex> lock(queueMutex);
+            admissionCV.wait(lock, [this] { return !admissionThrottled.load() || shutdownFlag.load(); });
+            for (const auto& rows : chunkRows) {
+                for (const auto& row : rows) {
+                    transactionQueue.emplace(makeTransferLogic(row.fromAccountId, row.toAccountId, row.amount),
+                                             5, "Bank transfer",
+                                             withDeclaredAccounts(TransactionOptions(), {row.fromAccountId, row.toAccountId}));
+                }
+            }
+            memoryAccounting.add(MemorySubsystem::TransactionQueue,
+                                 static_cast<long long>(totalRows) * queuedBytes("Bank transfer"));
+            activeTransactions += static_cast<int>(totalRows);
+        }
+        queueCV.notify_all();
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - submitStart).count();
+        return BulkLoadStats{totalRows, seconds, seconds > 0 ? totalRows / seconds : 0.0};
+    }
+
+    // Only one thread may publish a given instrument's quotes at a time.
+    void publishQuote(unsigned instrument, const Quote& quote) {
+        if (instrument >= kMaxQuotedInstruments) {
+            throw out_of_range("Instrument " + to_string(instrument) + " exceeds the quote store");
+        }
+        quoteStore.publish(instrument, quote);
+    }
+
+    // Lock-free; returns false if the instrument has never been quoted.
+    bool readQuote(unsigned instrument, Quote& quote) const {
+        if (instrument >= kMaxQuotedInstruments) {
+            throw out_of_range("Instrument " + to_string(instrument) + " exceeds the quote store");
+        }
+        return quoteStore.read(instrument, quote);
+    }
+
+    // Creates the feed file, typically under /dev/shm, with room for capacity
+    // messages; it must exceed the largest book snapshot. Each instrument's
+    // book is snapshotted after every snapshotEvery level updates.
+    void enableMarketDataFeed(const string& path, size_t capacity = 1 << 16, unsigned snapshotEvery = 1000) {
+        if (capacity == 0 || snapshotEvery == 0) {
+            throw invalid_argument("Feed capacity and snapshot interval must be positive");
+        }
+        lock_guard<mutex> lock(marketDataMutex);
+        if (marketDataFeed) {
+            throw runtime_error("Market data feed already enabled");
+        }
+        marketDataFeed.reset(new MarketDataFeed(path, capacity, snapshotEvery));
+    }
+
+    // Sets the total size resting at price; a size of 0 removes the level.
+    void updateBookLevel(unsigned instrument, BookSide side, double price, double size) {
+        lock_guard<mutex> lock(marketDataMutex);
+        requireMarketDataFeed().updateLevel(instrument, side, price, size);
+    }
+
+    void publishTradePrint(unsigned instrument, double price, double quantity) {
+        lock_guard<mutex> lock(marketDataMutex);
+        requireMarketDataFeed().trade(instrument, price, quantity);
+    }
+
+    // Snapshots every book now, e.g. before many subscribers attach.
+    void publishMarketDataSnapshot() {
+        lock_guard<mutex> lock(marketDataMutex);
+        requireMarketDataFeed().snapshotAll();
+    }
+
+    void setTransactionLogging(bool enabled) {
+        transactionLogging.store(enabled);
+    }
+
+    // Calls submit(options) at ratePerSecond on a fixed schedule for duration,
+    // whether or not earlier submissions have completed, then waits for all of
+    // them. submit must pass options to the transaction it schedules and return
+    // false if it was not queued. A rate whose interval rounds to less than one
+    // steady_clock tick cannot be scheduled and is rejected.
+    OpenLoopResult runOpenLoop(double ratePerSecond, chrono::steady_clock::duration duration,
+                               const function<bool(const TransactionOptions&)>& submit) {
+        if (!(ratePerSecond > 0.0)) {
+            throw invalid_argument("Open-loop rate must be positive");
+        }
+        auto interval = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0 / ratePerSecond));
+        if (interval <= chrono::steady_clock::duration::zero()) {
+            throw invalid_argument("Open-loop rate exceeds one submission per clock tick");
+        }
+        struct Progress {
+            LatencyHistogram latency;
+            atomic<size_t> outstanding{0};
+            atomic<size_t> failed{0};
+        };
+        auto progress = make_shared<Progress>();
+        auto start = chrono::steady_clock::now();
+        size_t submitted = 0;
+        for (auto intended = start; intended < start + duration; intended = start + interval * ++submitted) {
+            auto now = chrono::steady_clock::now();
+            if (intended - now > chrono::microseconds(100)) {
+                this_thread::sleep_until(intended - chrono::microseconds(50));
+            }
+            while (chrono::steady_clock::now() < intended) {
+                this_thread::yield();
+            }
+            TransactionOptions options;
+            options.onComplete = [progress, intended](bool committed) {
+                auto latency = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - intended);
+                progress->latency.record(static_cast<uint64_t>(latency.count()));
+                if (!committed) progress->failed.fetch_add(1, memory_order_relaxed);
+                progress->outstanding.fetch_sub(1, memory_order_release);
+            };
+            progress->outstanding.fetch_add(1, memory_order_relaxed);
+            if (!submit(options)) {
+                progress->outstanding.fetch_sub(1, memory_order_relaxed);
+                progress->failed.fetch_add(1, memory_order_relaxed);
+            }
+        }
+        while (progress->outstanding.load(memory_order_acquire) > 0) {
+            this_thread::sleep_for(chrono::microseconds(200));
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        size_t failed = progress->failed.load();
+        auto latency = shared_ptr<LatencyHistogram>(progress, &progress->latency);
+        return OpenLoopResult{ratePerSecond, (submitted - failed) / seconds, submitted - failed, failed, latency};
+    }
+
+    // Runs runOpenLoop at each rate in increasing order and stops after the first
+    // rate the system cannot sustain, completing under 95% of its target.
+    vector<OpenLoopResult> measureLatencyCurve(vector<double> rates, chrono::steady_clock::duration durationPerRate,
+                                               const function<bool(const TransactionOptions&)>& submit) {
+        sort(rates.begin(), rates.end());
+        vector<OpenLoopResult> curve;
+        for (double rate : rates) {
+            curve.push_back(runOpenLoop(rate, durationPerRate, submit));
+            if (curve.back().achievedRate < 0.95 * rate) break;
+        }
+        return curve;
+    }
+
+    // Starts the order flow ring with capacity (a power of two) preallocated
+    // entries and its three stage threads. Journal records are appended to
+    // journalPath; the risk stage rejects self-trades and amounts that are not
+    // positive or exceed maxOrderNotional.
+    void enableOrderFlow(const string& journalPath, size_t capacity = size_t{1} << 14,
+                         double maxOrderNotional = numeric_limits<double>::infinity()) {
+        if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+            throw invalid_argument("Order flow capacity must be a power of two");
+        }
+        if (orderFlowEntries) {
+            throw runtime_error("Order flow already enabled");
+        }
+        orderFlowJournalFd = open(journalPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (orderFlowJournalFd < 0) {
+            throw runtime_error("Cannot open " + journalPath);
+        }
+        orderFlowEntries.reset(new OrderFlowEntry[capacity]);
+        orderFlowMask = capacity - 1;
+        orderFlowMaxNotional = maxOrderNotional;
+        orderFlowStages.emplace_back(&FinancialTransactionSystem::orderFlowJournalStage, this);
+        orderFlowStages.emplace_back(&FinancialTransactionSystem::orderFlowRiskStage, this);
+        orderFlowStages.emplace_back(&FinancialTransactionSystem::orderFlowSettlementStage, this);
+    }
+
+    // Only one thread may submit at a time. Copies the order into the next ring
+    // entry, waiting while the ring is full, and returns its sequence.
+    uint64_t submitOrder(unsigned buyerAccountId, unsigned sellerAccountId, unsigned instrument, double amount) {
+        if (!orderFlowEntries) {
+            throw runtime_error("Order flow not enabled");
+        }
+        uint64_t sequence = ++orderFlowNext;
+        if (sequence > orderFlowMask + 1 &&
+            awaitOrderFlowSequence(orderFlowSettled.value, sequence - orderFlowMask - 1) == 0) {
+            throw runtime_error("Order flow stopped" + orderFlowErrorSuffix());
+        }
+        OrderFlowEntry& entry = orderFlowEntries[sequence & orderFlowMask];
+        entry.record = OrderFlowRecord{sequence, buyerAccountId, sellerAccountId, instrument, 0, amount};
+        entry.status = OrderFlowStatus::Accepted;
+        orderFlowCursor.value.store(sequence, memory_order_release);
+        return sequence;
+    }
+
+    // Waits until every submitted order has been settled, rejected or failed.
+    void waitForOrderFlow() {
+        uint64_t published = orderFlowCursor.value.load(memory_order_acquire);
+        if (published > 0 && awaitOrderFlowSequence(orderFlowSettled.value, published) == 0) {
+            throw runtime_error("Order flow stopped" + orderFlowErrorSuffix());
+        }
+    }
+
+    OrderFlowStats orderFlowStats() const {
+        return OrderFlowStats{orderFlowCursor.value.load(), orderFlowJournaled.value.load(),
+                              orderFlowSettled.value.load(), orderFlowRejected.load(), orderFlowFailed.load()};
+    }
+
+    // Crosses orders at the single price, a multiple of tickSize, that executes the
+    // most volume, then leaves the smallest imbalance, then lies closest to
+    // referencePrice (or in the middle of the remaining prices without one).
+    // Fills follow price then submission priority. All fills settle as one
+    // multi-leg transaction moving cash (asset 0) and positions in instrument,
+    // which completes before returning, so this must not run inside transaction
+    // logic. Orders that cannot settle are dropped before crossing: a bid needs
+    // cash for its quantity at its limit on top of the account's earlier bids, and
+    // an ask needs the position on top of its earlier asks. Missing position
+    // accounts of bidders and cash accounts of askers are created empty. The check
+    // reads newest balances, so a concurrent debit can still fail the settlement,
+    // which is reported by settled.
+    AuctionResult runCallAuction(unsigned instrument, const vector<AuctionOrder>& orders, double tickSize,
+                                 double referencePrice = 0.0,
+                                 const TransactionOptions& options = TransactionOptions()) {
+        auto auctionStart = chrono::steady_clock::now();
+        if (!(tickSize > 0.0) || !isfinite(tickSize)) {
+            throw invalid_argument("Tick size must be positive");
+        }
+        AuctionResult result{0.0, 0.0, {}, {}, false, 0.0};
+        if (orders.empty()) return result;
+
+        vector<long long> ticks(orders.size());
+        long long lowTick = numeric_limits<long long>::max();
+        long long highTick = numeric_limits<long long>::min();
+        for (size_t i = 0; i < orders.size(); ++i) {
+            const AuctionOrder& order = orders[i];
+            if (!(order.quantity > 0.0) || !isfinite(order.quantity) || !(order.limitPrice > 0.0) ||
+                !isfinite(order.limitPrice)) {
+                throw invalid_argument("Invalid auction order " + to_string(i));
+            }
+            // Limits off the tick grid round inward, bids down and asks up, so no
+            // order fills beyond its limit; the slack absorbs division error.
+            double scaled = order.limitPrice / tickSize;
+            if (!(scaled < 9.0e15)) {
+                throw invalid_argument("Auction order " + to_string(i) + " is too many ticks from zero");
+            }
+            ticks[i] = static_cast<long long>(order.side == BookSide::Bid ? floor(scaled + 1e-9) : ceil(scaled - 1e-9));
+            lowTick = min(lowTick, ticks[i]);
+            highTick = max(highTick, ticks[i]);
+        }
+        if (static_cast<unsigned long long>(highTick - lowTick) >= kMaxAuctionLadder) {
+            throw invalid_argument("Auction price range exceeds kMaxAuctionLadder ticks");
+        }
+        size_t levels = static_cast<size_t>(highTick - lowTick) + 1;
+
+        vector<char> eligible(orders.size(), 1);
+        {
+            static constexpr size_t kOrdersPerLock = 4096;
+            unordered_map<unsigned, double> committed;   // by funding account
+            for (size_t begin = 0; begin < orders.size(); begin += kOrdersPerLock) {
+                lock_guard<mutex> guard(globalLock);
+                auto newestBalance = [this](unsigned accountId, double& balance) {
+                    const AccountRecord* account = accountLookup.find(accountId);
+                    if (account != nullptr && !account->empty()) {
+                        balance = account->newestBalance();
+                    } else if (const ColdLocation* cold = coldLocationLocked(accountId)) {
+                        balance = cold->newestBalance;
+                    } else {
+                        return false;
+                    }
+                    return true;
+                };
+                for (size_t i = begin; i < min(orders.size(), begin + kOrdersPerLock); ++i) {
+                    bool bid = orders[i].side == BookSide::Bid;
+                    unsigned funding = positionAccount(orders[i].account, bid ? 0 : instrument);
+                    unsigned receiving = positionAccount(orders[i].account, bid ? instrument : 0);
+                    double need = bid ? orders[i].quantity * static_cast<double>(ticks[i]) * tickSize : orders[i].quantity;
+                    double balance;
+                    double& used = committed[funding];
+                    if (!newestBalance(funding, balance) || used + need > balance) {
+                        eligible[i] = 0;
+                        result.rejectedOrders.push_back(i);
+                        continue;
+                    }
+                    used += need;
+                    if (!newestBalance(receiving, balance)) {
+                        recordForWriteLocked(receiving).append(0, 0.0);
+                    }
+                }
+            }
+        }
+
+        // demand[l]: buy quantity willing to pay level l or more; supply[l]: sell
+        // quantity willing to accept level l or less.
+        vector<double> demand(levels, 0.0);
+        vector<double> supply(levels, 0.0);
+        vector<uint32_t> buyCounts(levels + 1, 0);
+        vector<uint32_t> sellCounts(levels + 1, 0);
+        for (size_t i = 0; i < orders.size(); ++i) {
+            if (!eligible[i]) continue;
+            size_t level = static_cast<size_t>(ticks[i] - lowTick);
+            if (orders[i].side == BookSide::Bid) {
+                demand[level] += orders[i].quantity;
+                ++buyCounts[level + 1];
+            } else {
+                supply[level] += orders[i].quantity;
+                ++sellCounts[level + 1];
+            }
+        }
+        for (size_t level = levels - 1; level > 0; --level) {
+            demand[level - 1] += demand[level];
+        }
+        for (size_t level = 1; level < levels; ++level) {
+            supply[level] += supply[level - 1];
+        }
+
+        double volume = maxExecutableVolume(demand.data(), supply.data(), levels);
+        if (volume <= 0.0) {
+            result.seconds = chrono::duration<double>(chrono::steady_clock::now() - auctionStart).count();
+            return result;
+        }
+        double imbalance = minImbalanceAtVolume(demand.data(), supply.data(), levels, volume);
+        size_t first = levels;
+        size_t last = 0;
+        size_t closest = levels;
+        double referenceTick = referencePrice / tickSize - static_cast<double>(lowTick);
+        for (size_t level = 0; level < levels; ++level) {
+            if (min(demand[level], supply[level]) != volume || fabs(demand[level] - supply[level]) != imbalance) {
+                continue;
+            }
+            first = min(first, level);
+            last = level;
+            if (closest == levels ||
+                fabs(static_cast<double>(level) - referenceTick) < fabs(static_cast<double>(closest) - referenceTick)) {
+                closest = level;
+            }
+        }
+        size_t priceLevel = referencePrice > 0.0 ? closest : first + (last - first) / 2;
+        double price = static_cast<double>(lowTick + static_cast<long long>(priceLevel)) * tickSize;
+        volume = min(demand[priceLevel], supply[priceLevel]);
+
+        // Orders grouped by level in submission order (a counting sort), copied so
+        // that allocation reads them sequentially.
+        struct QueuedOrder {
+            uint32_t index;
+            unsigned account;
+            double quantity;
+        };
+        for (size_t level = 0; level < levels; ++level) {
+            buyCounts[level + 1] += buyCounts[level];
+            sellCounts[level + 1] += sellCounts[level];
+        }
+        vector<QueuedOrder> buyers(buyCounts[levels]);
+        vector<QueuedOrder> sellers(sellCounts[levels]);
+        {
+            vector<uint32_t> buyNext(buyCounts.begin(), buyCounts.end() - 1);
+            vector<uint32_t> sellNext(sellCounts.begin(), sellCounts.end() - 1);
+            for (size_t i = 0; i < orders.size(); ++i) {
+                if (!eligible[i]) continue;
+                size_t level = static_cast<size_t>(ticks[i] - lowTick);
+                QueuedOrder queued{static_cast<uint32_t>(i), orders[i].account, orders[i].quantity};
+                if (orders[i].side == BookSide::Bid) {
+                    buyers[buyNext[level]++] = queued;
+                } else {
+                    sellers[sellNext[level]++] = queued;
+                }
+            }
+        }
+
+        // Fills are netted per account as they are allocated; settlement sorts
+        // only the distinct accounts.
+        unordered_map<unsigned, ResolvedLeg> netted;
+        result.fills.reserve(min(orders.size(), buyers.size() + sellers.size()));
+        auto credit = [&netted](unsigned accountId, double amount, bool nonNegative) {
+            auto entry = netted.try_emplace(accountId, ResolvedLeg{accountId, 0.0, false}).first;
+            entry->second.amount += amount;
+            entry->second.nonNegative = entry->second.nonNegative || nonNegative;
+        };
+        auto fill = [&](const QueuedOrder& order, bool buy, double& remaining) {
+            double quantity = min(order.quantity, remaining);
+            remaining -= quantity;
+            result.fills.push_back(AuctionFill{order.index, quantity});
+            double cash = quantity * price;
+            credit(positionAccount(order.account, 0), buy ? -cash : cash, buy);
+            credit(positionAccount(order.account, instrument), buy ? quantity : -quantity, !buy);
+        };
+        double remaining = volume;
+        for (size_t level = levels; level-- > priceLevel && remaining > 0.0;) {
+            for (uint32_t i = buyCounts[level]; i < buyCounts[level + 1] && remaining > 0.0; ++i) {
+                fill(buyers[i], true, remaining);
+            }
+        }
+        remaining = volume;
+        for (size_t level = 0; level <= priceLevel && remaining > 0.0; ++level) {
+            for (uint32_t i = sellCounts[level]; i < sellCounts[level + 1] && remaining > 0.0; ++i) {
+                fill(sellers[i], false, remaining);
+            }
+        }
+        vector<ResolvedLeg> legs;
+        legs.reserve(netted.size());
+        for (const auto& entry : netted) {
+            legs.push_back(entry.second);
+        }
+        sort(legs.begin(), legs.end(),
+             [](const ResolvedLeg& a, const ResolvedLeg& b) { return a.accountId < b.accountId; });
+
+        // Waits for the settlement, chaining any completion callback of the caller.
+        auto settlement = make_shared<promise<bool>>();
+        future<bool> settled = settlement->get_future();
+        TransactionOptions settleOptions = options;
+        settleOptions.onComplete = [settlement, callback = options.onComplete](bool success) {
+            if (callback) callback(success);
+            settlement->set_value(success);
+        };
+        result.price = price;
+        result.settled = executeResolvedLegs(move(legs), settleOptions, "Auction settlement") && settled.get();
+        if (result.settled) {
+            result.volume = volume;
+            lock_guard<mutex> lock(marketDataMutex);
+            if (marketDataFeed) {
+                marketDataFeed->trade(instrument, price, volume);
+            }
+        } else {
+            result.fills.clear();
+        }
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - auctionStart).count();
+        return result;
+    }
+
+    // Executes all legs atomically, or none if any NonNegative constraint fails.
+    // Legs on the same account are merged, and the merged leg is NonNegative if
+    // any of them is.
+    bool executeMultiLeg(const vector<Leg>& legs, const TransactionOptions& options = TransactionOptions(),
+                         const string& description = "Multi-leg settlement") {
+        return executeResolvedLegs(resolveLegs(legs), options, description);
+    }
+
+    bool executeCryptoTrade(unsigned buyerAccountId, unsigned sellerAccountId, double cryptoAmount, double fiatAmount,
+                            const TransactionOptions& options = TransactionOptions()) {
+        return scheduleTransaction([buyerAccountId, sellerAccountId, cryptoAmount, fiatAmount](Transaction& tx) {
+            double buyerFiatBalance = tx.readBalance(buyerAccountId);
+            double sellerCryptoBalance = tx.readBalance(sellerAccountId);
+
+            if (buyerFiatBalance >= fiatAmount && sellerCryptoBalance >= cryptoAmount) {
+                tx.updateBalance(buyerAccountId, buyerFiatBalance - fiatAmount);
+                tx.updateBalance(sellerAccountId, sellerCryptoBalance - cryptoAmount);
+                
+                unsigned buyerCryptoWalletId = buyerAccountId + 1000000;
+                unsigned sellerFiatWalletId = sellerAccountId + 2000000;
+                
+                double buyerCryptoBalance = tx.readBalance(buyerCryptoWalletId);
+                double sellerFiatBalance = tx.readBalance(sellerFiatWalletId);
+                
+                tx.updateBalance(buyerCryptoWalletId, buyerCryptoBalance + cryptoAmount);
+                tx.updateBalance(sellerFiatWalletId, sellerFiatBalance + fiatAmount);
+            } else {
+                throw runtime_error("Insufficient funds for crypto trade");
+            }
+        }, 10, "Crypto trade", withDeclaredAccounts(options, {buyerAccountId, sellerAccountId,
+                                                               buyerAccountId + 1000000, sellerAccountId + 2000000}));
+    }
+
+    // A client without its own limit uses the default limit, if one is set, and is
+    // otherwise unlimited. Burst is capped at ClientRateLimiter::kMaxBurst tokens.
+    // Throws only when every slot the client can probe holds an active client.
+    void setClientRateLimit(unsigned clientId, uint32_t ratePerSecond, uint32_t burst) {
+        if (clientId == 0) {
+            throw invalid_argument("Client 0 is reserved for unattributed submissions");
+        }
+        if (!rateLimiter.configure(clientId, ratePerSecond, burst)) {
+            throw runtime_error("Rate limiter table full");
+        }
+    }
+
+    void setDefaultClientRateLimit(uint32_t ratePerSecond, uint32_t burst) {
+        rateLimiter.setDefault(ratePerSecond, burst);
+    }
+
+    // Weights apply to TransactionOptions::schedulingClass; unconfigured classes weigh 1.
+    void setSchedulingClassWeight(unsigned schedulingClass, unsigned weight) {
+        lock_guard<mutex> lock(queueMutex);
+        transactionQueue.setWeight(schedulingClass, weight);
+    }
+
+    // Workers dequeue up to this many transactions at once when the queue is deep
+    // and prefetch the declared accounts of the next ones while each executes.
+    // A depth of 1 disables batching.
+    void setPrefetchDepth(unsigned transactions) {
+        prefetchDepth.store(max(1u, transactions));
+    }
+
+    size_t rateLimitedSubmissionCount() const {
+        return rateLimitedSubmissions.load();
+    }
+
+    size_t memoryUsage(MemorySubsystem subsystem) const {
+        return memoryAccounting.usage(subsystem);
+    }
+
+    // Crossing the soft VersionChains budget triggers version GC; crossing a hard
+    // budget on VersionChains or AccountIndex evicts dormant accounts if a cold
+    // store is enabled. TransactionQueue throttles admission once usage crosses its
+    // hard budget and releases submitters when usage falls back below the soft one.
+    void setMemoryBudget(MemorySubsystem subsystem, size_t softBytes, size_t hardBytes) {
+        lock_guard<mutex> lock(budgetMutex);
+        memoryBudgets[static_cast<size_t>(subsystem)] = MemoryBudget{softBytes, hardBytes};
+    }
+
+    void setVersionRetention(unsigned retainCommits) {
+        versionRetentionCommits.store(retainCommits);
+    }
+
+    void setBudgetEvictionThreshold(unsigned idleCommits) {
+        budgetEvictionIdleCommits.store(idleCommits);
+    }
+
+    // Frees version blocks that no active snapshot can read: blocks holding only
+    // versions older than the newest version at or below min(oldest SSI snapshot,
+    // clock - retainCommits). Detached blocks are freed once lock-free readers drain.
+    // Transactions older than that window fail to find a version and are retried.
+    size_t collectVersionGarbage(unsigned retainCommits) {
+        static constexpr size_t kAccountsPerLock = 4096;
+        size_t reclaimed = 0;
+        unsigned nextAccountId = 0;
+        bool done = false;
+        vector<VersionBlock*> detached;
+        while (!done) {
+            lock_guard<mutex> guard(globalLock);
+            if (activeScans.load() > 0) break;
+            unsigned now = globalClock.load();
+            unsigned horizon = now > retainCommits ? now - retainCommits : 0;
+            if (!activeSnapshots.empty()) {
+                horizon = min(horizon, *activeSnapshots.begin());
+            }
+            auto it = versionedData.lower_bound(nextAccountId);
+            for (size_t batch = 0; batch < kAccountsPerLock && it != versionedData.end(); ++batch, ++it) {
+                size_t dropped;
+                if (VersionBlock* blocks = it->second.detachBefore(horizon, dropped)) {
+                    detached.push_back(blocks);
+                    reclaimed += dropped;
+                }
+            }
+            if (it == versionedData.end()) {
+                done = true;
+            } else {
+                nextAccountId = it->first;
+            }
+        }
+        if (!detached.empty()) {
+            versionReaders.synchronize();
+            for (VersionBlock* blocks : detached) {
+                VersionBlock::destroyChain(blocks, memoryAccounting);
+            }
+        }
+        return reclaimed;
+    }
+
+    // Serves the newest balance from the last published snapshot without touching
+    // transactions, globalClock or versionedData. When the snapshot is older than
+    // maxStaleness or lacks the account, that one account is read under globalLock
+    // and reported as of the current clock.
+    StaleBalance readBalanceWithin(unsigned accountId, chrono::microseconds maxStaleness) {
+        auto snapshot = atomic_load(&balanceSnapshot);
+        if (snapshot && chrono::steady_clock::now() - snapshot->asOf <= maxStaleness) {
+            if (const auto* slot = snapshot->find(accountId)) {
+                return StaleBalance{slot->balance, snapshot->asOfTimestamp, snapshot->asOf};
+            }
+        }
+        lock_guard<mutex> guard(globalLock);
+        StaleBalance current{0.0, globalClock.load(), chrono::steady_clock::now()};
+        const AccountRecord* account = accountLookup.find(accountId);
+        if (account != nullptr && !account->empty()) {
+            current.balance = account->newestBalance();
+        } else if (const ColdLocation* cold = coldLocationLocked(accountId)) {
+            current.balance = cold->newestBalance;
+        } else {
+            throw out_of_range("Account not found");
+        }
+        return current;
+    }
+
+    void publishBalanceSnapshot() {
+        lock_guard<mutex> publishGuard(snapshotPublishMutex);
+        atomic_store(&balanceSnapshot, buildBalanceSnapshot());
+    }
+
+private:
+    size_t coldFilterBit(unsigned accountId, unsigned hash) const {
+        uint64_t mixed = static_cast<uint64_t>(accountId) * 0x9E3779B97F4A7C15ull;
+        uint64_t step = (mixed >> 32) | 1;
+        return static_cast<size_t>(mixed + hash * step) & (coldFilterBits.load(memory_order_relaxed) - 1);
+    }
+
+    void markCold(unsigned accountId) {
+        for (unsigned hash = 0; hash < kColdFilterHashes; ++hash) {
+            size_t bit = coldFilterBit(accountId, hash);
+            coldFilter[bit / 64].fetch_or(uint64_t{1} << (bit % 64), memory_order_relaxed);
+        }
+    }
+
+    bool mayBeCold(unsigned accountId) const {
+        if (coldFilterBits.load() == 0) return false;
+        for (unsigned hash = 0; hash < kColdFilterHashes; ++hash) {
+            size_t bit = coldFilterBit(accountId, hash);
+            if ((coldFilter[bit / 64].load(memory_order_relaxed) & (uint64_t{1} << (bit % 64))) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-        TransactionInfo(function<void(Transaction&)> l, int p, string desc)
-            : logic(move(l)), priority(p), description(move(desc)), startTime(chrono::steady_clock::now()) {}
-    };
+    void writeColdStore(const char* data, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t written = pwrite(coldStoreFd, data, size, static_cast<off_t>(offset));
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("Cold store write failed: " + string(strerror(errno)));
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+            offset += static_cast<uint64_t>(written);
+        }
+    }
 
-    struct CompareTransactionInfo {
-        bool operator()(const TransactionInfo& lhs, const TransactionInfo& rhs) {
-            if (lhs.priority != rhs.priority) {
-                return lhs.priority < rhs.priority;
+    AccountRecord readColdRecord(const ColdLocation& location) const {
+        vector<ColdVersion> cold(location.versionCount);
+        size_t size = cold.size() * sizeof(ColdVersion);
+        char* data = reinterpret_cast<char*>(cold.data());
+        off_t offset = static_cast<off_t>(location.offset + sizeof(ColdRecordHeader));
+        while (size > 0) {
+            ssize_t bytesRead = pread(coldStoreFd, data, size, offset);
+            if (bytesRead <= 0) {
+                if (bytesRead < 0 && errno == EINTR) continue;
+                throw runtime_error("Cold store read failed");
             }
-            return lhs.startTime > rhs.startTime;
+            data += bytesRead;
+            size -= static_cast<size_t>(bytesRead);
+            offset += bytesRead;
         }
-    };
+        AccountRecord account(memoryAccounting);
+        for (const auto& version : cold) {
+            account.append(version.timestamp, version.balance);
+        }
+        return account;
+    }
 
-    map<unsigned, vector<pair<unsigned, double>>> versionedData;
-    mutex globalLock;
-    mt19937 rng;
+    // Requires globalLock.
+    const ColdLocation* coldLocationLocked(unsigned accountId) const {
+        if (coldIndex.empty()) return nullptr;
+        auto it = coldIndex.find(accountId);
+        return it == coldIndex.end() ? nullptr : &it->second;
+    }
 
-    vector<thread> workerThreads;
-    priority_queue<TransactionInfo, vector<TransactionInfo>, CompareTransactionInfo> transactionQueue;
-    mutex queueMutex;
-    condition_variable queueCV;
-    atomic<bool> shutdownFlag{false};
-    atomic<unsigned> globalClock{0};
-    atomic<int> activeTransactions{0};
+    // Requires globalLock.
+    unsigned coldNewestTimestampLocked(unsigned accountId) const {
+        const ColdLocation* location = coldLocationLocked(accountId);
+        return location ? location->newestTimestamp : 0;
+    }
 
-public:
-    FinancialTransactionSystem(unsigned numThreads = thread::hardware_concurrency())
-        : rng(random_device{}()) {
-        for (unsigned i = 0; i < numThreads; ++i) {
-            workerThreads.emplace_back(&FinancialTransactionSystem::workerFunction, this);
+    // Requires globalLock. Hydrates an evicted account in place, or creates it.
+    AccountRecord& recordForWriteLocked(unsigned accountId) {
+        if (AccountRecord* account = accountLookup.find(accountId)) {
+            return *account;
+        }
+        AccountRecord hydrated(memoryAccounting);
+        if (const ColdLocation* location = coldLocationLocked(accountId)) {
+            hydrated = readColdRecord(*location);
+            lock_guard<mutex> coldGuard(coldMutex);
+            coldIndex.erase(accountId);
         }
+        AccountRecord& account = versionedData.emplace(accountId, move(hydrated)).first->second;
+        accountLookup.insert(accountId, &account);
+        return account;
     }
 
-    ~FinancialTransactionSystem() {
-        shutdownFlag.store(true);
-        queueCV.notify_all();
-        for (auto& thread : workerThreads) {
-            thread.join();
+    // Loads an evicted account back into versionedData without holding globalLock
+    // during the read. Returns false if the account was never evicted.
+    bool hydrateAccount(unsigned accountId) {
+        if (!mayBeCold(accountId)) return false;
+        ColdLocation location;
+        {
+            lock_guard<mutex> coldGuard(coldMutex);
+            auto it = coldIndex.find(accountId);
+            if (it == coldIndex.end()) {
+                return false;
+            }
+            location = it->second;
         }
-    }
+        AccountRecord hydrated = readColdRecord(location);
 
-    void createAccount(unsigned accountId, double initialBalance) {
         lock_guard<mutex> guard(globalLock);
-        versionedData[accountId].emplace_back(0, initialBalance);
+        lock_guard<mutex> coldGuard(coldMutex);
+        auto it = coldIndex.find(accountId);
+        if (it != coldIndex.end() && it->second.offset == location.offset) {
+            AccountRecord& account = versionedData.emplace(accountId, move(hydrated)).first->second;
+            accountLookup.insert(accountId, &account);
+            coldIndex.erase(it);
+        }
+        return true;
     }
 
-    class Transaction {
-    private:
-        FinancialTransactionSystem& parentSystem;
-        map<unsigned, pair<double, unsigned>> readSet;
-        map<unsigned, double> writeSet;
-        unsigned startTimestamp;
-        unsigned endTimestamp;
-
-    public:
-        Transaction(FinancialTransactionSystem& system)
-            : parentSystem(system), startTimestamp(system.globalClock.load()) {}
+    static function<void(Transaction&)> makeTransferLogic(unsigned fromAccountId, unsigned toAccountId, double amount) {
+        return [fromAccountId, toAccountId, amount](Transaction& tx) {
+            double fromBalance = tx.readBalance(fromAccountId);
+            double toBalance = tx.readBalance(toAccountId);
 
-        double readBalance(unsigned accountId) {
-            if (writeSet.find(accountId) != writeSet.end()) {
-                return writeSet[accountId];
+            if (fromBalance >= amount) {
+                tx.updateBalance(fromAccountId, fromBalance - amount);
+                tx.updateBalance(toAccountId, toBalance + amount);
+            } else {
+                throw runtime_error("Insufficient funds for transfer");
             }
+        };
+    }
 
-            lock_guard<mutex> guard(parentSystem.globalLock);
-            auto it = parentSystem.versionedData.find(accountId);
-            if (it == parentSystem.versionedData.end()) {
-                throw out_of_range("Account not found");
+    static double maxExecutableVolume(const double* demand, const double* supply, size_t levels) {
+        double best = 0.0;
+        size_t level = 0;
+#if defined(__AVX2__)
+        __m256d bestLanes = _mm256_setzero_pd();
+        for (; level + 4 <= levels; level += 4) {
+            bestLanes = _mm256_max_pd(bestLanes, _mm256_min_pd(_mm256_loadu_pd(demand + level),
+                                                                _mm256_loadu_pd(supply + level)));
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, bestLanes);
+        best = max(max(lanes[0], lanes[1]), max(lanes[2], lanes[3]));
+#elif defined(__SSE2__)
+        __m128d bestLanes = _mm_setzero_pd();
+        for (; level + 2 <= levels; level += 2) {
+            bestLanes = _mm_max_pd(bestLanes, _mm_min_pd(_mm_loadu_pd(demand + level), _mm_loadu_pd(supply + level)));
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, bestLanes);
+        best = max(lanes[0], lanes[1]);
+#endif
+        for (; level < levels; ++level) {
+            best = max(best, min(demand[level], supply[level]));
+        }
+        return best;
+    }
+
+    // Smallest |demand - supply| among levels executing exactly volume.
+    static double minImbalanceAtVolume(const double* demand, const double* supply, size_t levels, double volume) {
+        double best = numeric_limits<double>::infinity();
+        size_t level = 0;
+#if defined(__AVX2__)
+        const __m256d target = _mm256_set1_pd(volume);
+        const __m256d absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+        const __m256d none = _mm256_set1_pd(numeric_limits<double>::infinity());
+        __m256d bestLanes = none;
+        for (; level + 4 <= levels; level += 4) {
+            __m256d d = _mm256_loadu_pd(demand + level);
+            __m256d s = _mm256_loadu_pd(supply + level);
+            __m256d hit = _mm256_cmp_pd(_mm256_min_pd(d, s), target, _CMP_EQ_OQ);
+            __m256d imbalance = _mm256_and_pd(_mm256_sub_pd(d, s), absMask);
+            bestLanes = _mm256_min_pd(bestLanes, _mm256_blendv_pd(none, imbalance, hit));
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, bestLanes);
+        best = min(min(lanes[0], lanes[1]), min(lanes[2], lanes[3]));
+#elif defined(__SSE2__)
+        const __m128d target = _mm_set1_pd(volume);
+        const __m128d absMask = _mm_castsi128_pd(_mm_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+        const __m128d none = _mm_set1_pd(numeric_limits<double>::infinity());
+        __m128d bestLanes = none;
+        for (; level + 2 <= levels; level += 2) {
+            __m128d d = _mm_loadu_pd(demand + level);
+            __m128d s = _mm_loadu_pd(supply + level);
+            __m128d hit = _mm_cmpeq_pd(_mm_min_pd(d, s), target);
+            __m128d imbalance = _mm_and_pd(_mm_sub_pd(d, s), absMask);
+            bestLanes = _mm_min_pd(bestLanes, _mm_or_pd(_mm_and_pd(hit, imbalance), _mm_andnot_pd(hit, none)));
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, bestLanes);
+        best = min(lanes[0], lanes[1]);
+#endif
+        for (; level < levels; ++level) {
+            if (min(demand[level], supply[level]) == volume) {
+                best = min(best, fabs(demand[level] - supply[level]));
             }
+        }
+        return best;
+    }
 
-            const auto& versions = it->second;
-            auto versionIt = lower_bound(versions.rbegin(), versions.rend(), 
-                                         make_pair(startTimestamp, 0.0),
-                                         [](const auto& a, const auto& b) { return a.first > b.first; });
+    // legs must be sorted by account ID without duplicates.
+    bool executeResolvedLegs(vector<ResolvedLeg> legs, const TransactionOptions& options, const string& description) {
+        auto resolved = make_shared<const vector<ResolvedLeg>>(move(legs));
+        TransactionOptions declared = options;
+        declared.declaredAccountCount = 0;
+        for (const auto& leg : *resolved) {
+            declared.declareAccount(leg.accountId);
+        }
+        return scheduleTransaction([resolved](Transaction& tx) { tx.applyLegs(*resolved); },
+                                   10, description, declared);
+    }
 
-            if (versionIt == versions.rend()) {
-                throw runtime_error("No valid version found for account " + to_string(accountId));
+    // Requires marketDataMutex.
+    MarketDataFeed& requireMarketDataFeed() {
+        if (!marketDataFeed) {
+            throw runtime_error("Market data feed not enabled");
+        }
+        return *marketDataFeed;
+    }
+
+    static vector<ResolvedLeg> resolveLegs(const vector<Leg>& legs) {
+        if (legs.empty()) {
+            throw invalid_argument("A multi-leg transaction needs at least one leg");
+        }
+        vector<ResolvedLeg> resolved;
+        resolved.reserve(legs.size());
+        for (const auto& leg : legs) {
+            if (!isfinite(leg.amount)) {
+                throw invalid_argument("Leg amount must be finite");
             }
-            readSet[accountId] = make_pair(versionIt->second, versionIt->first);
-            return versionIt->second;
+            resolved.push_back(ResolvedLeg{positionAccount(leg.account, leg.asset), leg.amount,
+                                           leg.constraint == LegConstraint::NonNegative});
         }
+        sort(resolved.begin(), resolved.end(),
+             [](const ResolvedLeg& a, const ResolvedLeg& b) { return a.accountId < b.accountId; });
+        size_t last = 0;
+        for (size_t i = 1; i < resolved.size(); ++i) {
+            if (resolved[i].accountId == resolved[last].accountId) {
+                resolved[last].amount += resolved[i].amount;
+                resolved[last].nonNegative = resolved[last].nonNegative || resolved[i].nonNegative;
+            } else {
+                resolved[++last] = resolved[i];
+            }
+        }
+        resolved.resize(last + 1);
+        return resolved;
+    }
 
-        void updateBalance(unsigned accountId, double newBalance) {
-            writeSet[accountId] = newBalance;
+    static TransactionOptions withDeclaredAccounts(TransactionOptions options, initializer_list<unsigned> accounts) {
+        options.declaredAccountCount = 0;
+        for (unsigned accountId : accounts) {
+            options.declareAccount(accountId);
         }
+        return options;
+    }
 
-        bool commit() {
-            lock_guard<mutex> guard(parentSystem.globalLock);
-            
-            endTimestamp = ++parentSystem.globalClock;
-            
-            for (const auto& entry : readSet) {
-                unsigned accountId = entry.first;
-                unsigned readVersion = entry.second.second;
-                const auto& versions = parentSystem.versionedData[accountId];
-                auto it = lower_bound(versions.begin(), versions.end(), 
-                                      make_pair(endTimestamp, 0.0),
-                                      [](const auto& a, const auto& b) { return a.first < b.first; });
-                if (it != versions.begin()) {
-                    --it;
-                    if (it->first > readVersion) {
-                        return false;  // Conflict detected
-                    }
-                }
-            }
+    static long long queuedBytes(const string& description) {
+        return static_cast<long long>(sizeof(TransactionInfo) + description.capacity());
+    }
 
-            for (const auto& entry : writeSet) {
-                unsigned accountId = entry.first;
-                double newBalance = entry.second;
-                parentSystem.versionedData[accountId].emplace_back(endTimestamp, newBalance);
-            }
+    void enforceMemoryBudgets() {
+        MemoryBudget budgets[MemoryAccounting::kSubsystems];
+        {
+            lock_guard<mutex> lock(budgetMutex);
+            copy(begin(memoryBudgets), end(memoryBudgets), begin(budgets));
+        }
+        auto over = [&](MemorySubsystem subsystem, bool hard) {
+            const MemoryBudget& budget = budgets[static_cast<size_t>(subsystem)];
+            return memoryUsage(subsystem) > (hard ? budget.hardBytes : budget.softBytes);
+        };
 
-            return true;
+        auto now = chrono::steady_clock::now();
+        if (over(MemorySubsystem::VersionChains, false) && gcBackoff.due(now)) {
+            gcBackoff.record(collectVersionGarbage(versionRetentionCommits.load()) > 0, now);
+        }
+        if ((over(MemorySubsystem::VersionChains, true) || over(MemorySubsystem::AccountIndex, true)) &&
+            coldStoreFd.load() >= 0 && evictionBackoff.due(now)) {
+            evictionBackoff.record(evictDormantAccounts(budgetEvictionIdleCommits.load()) > 0, now);
         }
-    };
 
-    void scheduleTransaction(const function<void(Transaction&)>& transactionLogic, int priority, const string& description) {
-        lock_guard<mutex> lock(queueMutex);
-        transactionQueue.emplace(transactionLogic, priority, description);
-        activeTransactions++;
-        queueCV.notify_one();
+        bool throttle = admissionThrottled.load() ? over(MemorySubsystem::TransactionQueue, false)
+                                                  : over(MemorySubsystem::TransactionQueue, true);
+        if (throttle != admissionThrottled.load()) {
+            lock_guard<mutex> lock(queueMutex);
+            admissionThrottled.store(throttle);
+            admissionCV.notify_all();
+        }
     }
 
-    void executeTrade(unsigned buyerAccountId, unsigned sellerAccountId, double amount) {
-        scheduleTransaction([buyerAccountId, sellerAccountId, amount](Transaction& tx) {
-            double buyerBalance = tx.readBalance(buyerAccountId);
-            double sellerBalance = tx.readBalance(sellerAccountId);
+    // Copies newest balances with globalLock held only for a bounded batch of cold
+    // buckets or resident accounts at a time, so every balance reflects at least the
+    // commits up to the clock read at the start. Cold entries go first so that an
+    // account hydrated meanwhile keeps its resident balance. An account evicted
+    // between batches may be missing and is then read directly by readBalanceWithin.
+    shared_ptr<const BalanceSnapshot> buildBalanceSnapshot() {
+        static constexpr size_t kAccountsPerLock = 4096;
+        vector<pair<unsigned, double>> balances;
+        unsigned timestamp;
+        chrono::steady_clock::time_point asOf;
+        size_t coldBuckets;
+        {
+            lock_guard<mutex> guard(globalLock);
+            timestamp = globalClock.load();
+            asOf = chrono::steady_clock::now();
+            balances.reserve(versionedData.size() + coldIndex.size());
+            coldBuckets = coldIndex.bucket_count();
+        }
 
-            if (buyerBalance >= amount) {
-                tx.updateBalance(buyerAccountId, buyerBalance - amount);
-                tx.updateBalance(sellerAccountId, sellerBalance + amount);
-            } else {
-                throw runtime_error("Insufficient funds for trade");
+        // Grows balances outside globalLock, with room for a batch at full load factor.
+        auto reserveBatch = [&balances] {
+            if (balances.capacity() - balances.size() < 2 * kAccountsPerLock) {
+                balances.reserve(balances.size() * 2 + 2 * kAccountsPerLock);
             }
-        }, 10, "Stock trade");
-    }
+        };
 
-    void transferFunds(unsigned fromAccountId, unsigned toAccountId, double amount) {
-        scheduleTransaction([fromAccountId, toAccountId, amount](Transaction& tx) {
-            double fromBalance = tx.readBalance(fromAccountId);
-            double toBalance = tx.readBalance(toAccountId);
+        // A rehash of coldIndex between batches moves entries across buckets, so the
+        // cold pass restarts; growth is geometric, so restarts are rare.
+        for (size_t bucket = 0; bucket < coldBuckets;) {
+            reserveBatch();
+            lock_guard<mutex> guard(globalLock);
+            if (coldIndex.bucket_count() != coldBuckets) {
+                coldBuckets = coldIndex.bucket_count();
+                balances.clear();
+                bucket = 0;
+            }
+            size_t endBucket = min(coldBuckets, bucket + kAccountsPerLock);
+            for (; bucket < endBucket; ++bucket) {
+                for (auto it = coldIndex.begin(bucket); it != coldIndex.end(bucket); ++it) {
+                    balances.emplace_back(it->first, it->second.newestBalance);
+                }
+            }
+        }
 
-            if (fromBalance >= amount) {
-                tx.updateBalance(fromAccountId, fromBalance - amount);
-                tx.updateBalance(toAccountId, toBalance + amount);
-            } else {
-                throw runtime_error("Insufficient funds for transfer");
+        for (uint64_t nextAccountId = 0; nextAccountId <= numeric_limits<unsigned>::max();) {
+            reserveBatch();
+            lock_guard<mutex> guard(globalLock);
+            auto it = versionedData.lower_bound(static_cast<unsigned>(nextAccountId));
+            for (size_t batch = 0; it != versionedData.end() && batch < kAccountsPerLock; ++it, ++batch) {
+                if (!it->second.empty()) {
+                    balances.emplace_back(it->first, it->second.newestBalance());
+                }
             }
-        }, 5, "Bank transfer");
+            nextAccountId = it == versionedData.end() ? uint64_t{numeric_limits<unsigned>::max()} + 1 : it->first;
+        }
+        return make_shared<const BalanceSnapshot>(balances, timestamp, asOf, memoryAccounting);
     }
 
-    void executeCryptoTrade(unsigned buyerAccountId, unsigned sellerAccountId, double cryptoAmount, double fiatAmount) {
-        scheduleTransaction([buyerAccountId, sellerAccountId, cryptoAmount, fiatAmount](Transaction& tx) {
-            double buyerFiatBalance = tx.readBalance(buyerAccountId);
-            double sellerCryptoBalance = tx.readBalance(sellerAccountId);
+    void snapshotPublisherFunction() {
+        while (!shutdownFlag.load()) {
+            {
+                unique_lock<mutex> lock(snapshotMutex);
+                snapshotCV.wait_for(lock, chrono::microseconds(snapshotIntervalMicros.load()),
+                                    [this] { return shutdownFlag.load(); });
+            }
+            if (shutdownFlag.load()) return;
+            // A failure here, such as a cold-store write error, is reported and the
+            // budget passes back off; publishing carries on next tick.
+            try {
+                if (balanceSnapshotsEnabled.load()) {
+                    publishBalanceSnapshot();
+                }
+                enforceMemoryBudgets();
+                reclaimRetiredLookupTables();
+                mergeExposures();
+            } catch (const exception& e) {
+                cout << "Background maintenance error: " << e.what() << endl;
+                auto now = chrono::steady_clock::now();
+                gcBackoff.record(false, now);
+                evictionBackoff.record(false, now);
+            }
+        }
+    }
 
-            if (buyerFiatBalance >= fiatAmount && sellerCryptoBalance >= cryptoAmount) {
-                tx.updateBalance(buyerAccountId, buyerFiatBalance - fiatAmount);
-                tx.updateBalance(sellerAccountId, sellerCryptoBalance - cryptoAmount);
-                
-                unsigned buyerCryptoWalletId = buyerAccountId + 1000000;
-                unsigned sellerFiatWalletId = sellerAccountId + 2000000;
-                
-                double buyerCryptoBalance = tx.readBalance(buyerCryptoWalletId);
-                double sellerFiatBalance = tx.readBalance(sellerFiatWalletId);
-                
-                tx.updateBalance(buyerCryptoWalletId, buyerCryptoBalance + cryptoAmount);
-                tx.updateBalance(sellerFiatWalletId, sellerFiatBalance + fiatAmount);
-            } else {
-                throw runtime_error("Insufficient funds for crypto trade");
+    // Frees lookup tables replaced by growth once no lock-free reader can see them.
+    void reclaimRetiredLookupTables() {
+        auto retired = [this] {
+            lock_guard<mutex> guard(globalLock);
+            return accountLookup.takeRetired();
+        }();
+        if (retired.empty()) return;
+        versionReaders.synchronize();
+        retired.clear();
+    }
+
+    void prefetchLookupSlots(const TransactionInfo& info) {
+        VersionReadGuard guard(versionReaders);
+        for (unsigned i = 0; i < info.declaredAccountCount; ++i) {
+            __builtin_prefetch(accountLookup.slotAddress(info.declaredAccounts[i]));
+        }
+    }
+
+    void prefetchAccountRecords(const TransactionInfo& info) {
+        VersionReadGuard guard(versionReaders);
+        for (unsigned i = 0; i < info.declaredAccountCount; ++i) {
+            if (const AccountRecord* account = accountLookup.find(info.declaredAccounts[i])) {
+                __builtin_prefetch(account);
             }
-        }, 10, "Crypto trade");
+        }
     }
 
-private:
+    // Dequeues a batch only when every worker would still find work, so a shallow
+    // queue keeps its strict dispatch order. Within a batch, lookup slots are
+    // prefetched two transactions ahead and account records one ahead.
     void workerFunction() {
+        vector<TransactionInfo> batch;
+        vector<function<void(bool)>> expiredCallbacks;
         while (!shutdownFlag.load()) {
-            unique_ptr<TransactionInfo> transactionInfo;
+            batch.clear();
             {
                 unique_lock<mutex> lock(queueMutex);
-                queueCV.wait(lock, [this] { return !transactionQueue.empty() || shutdownFlag.load(); });
-                if (shutdownFlag.load()) return;
-                transactionInfo.reset(new TransactionInfo(transactionQueue.top()));
-                transactionQueue.pop();
+                while (batch.empty() && expiredCallbacks.empty()) {
+                    queueCV.wait(lock, [this] { return !transactionQueue.empty() || shutdownFlag.load(); });
+                    if (shutdownFlag.load()) return;
+                    size_t take = min<size_t>(prefetchDepth.load(),
+                                              max<size_t>(1, transactionQueue.size() / workerCount));
+                    auto now = chrono::steady_clock::now();
+                    while (!transactionQueue.empty() && batch.size() < take) {
+                        memoryAccounting.add(MemorySubsystem::TransactionQueue, -queuedBytes(transactionQueue.top().description));
+                        if (transactionQueue.top().expired(now)) {
+                            droppedTransactions++;
+                            if (transactionQueue.top().onComplete) {
+                                expiredCallbacks.push_back(transactionQueue.top().onComplete);
+                            } else {
+                                activeTransactions--;
+                            }
+                        } else {
+                            batch.push_back(transactionQueue.top());
+                        }
+                        transactionQueue.pop();
+                    }
+                }
+            }
+
+            // Run outside queueMutex, since a callback may schedule more work.
+            for (const auto& callback : expiredCallbacks) {
+                callback(false);
+                activeTransactions--;
+            }
+            expiredCallbacks.clear();
+
+            for (size_t i = 0; i < batch.size() && i < 2; ++i) {
+                prefetchLookupSlots(batch[i]);
+            }
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (i + 2 < batch.size()) prefetchLookupSlots(batch[i + 2]);
+                if (i + 1 < batch.size()) prefetchAccountRecords(batch[i + 1]);
+                executeQueuedTransaction(batch[i]);
+            }
+        }
+    }
+
+    // Returns false, leaving tx unchanged, when the buyer cannot pay amount and fee.
+    static bool applyTrade(Transaction& tx, const CompiledFeeSchedule* schedule, unsigned buyerAccountId,
+                           unsigned sellerAccountId, unsigned instrument, double amount) {
+        double fee = schedule ? schedule->fee(buyerAccountId, instrument, amount) : 0.0;
+        double buyerBalance = tx.readBalance(buyerAccountId);
+        double sellerBalance = tx.readBalance(sellerAccountId);
+        if (buyerBalance < amount + fee) {
+            return false;
+        }
+        tx.updateBalance(buyerAccountId, buyerBalance - amount - fee);
+        tx.updateBalance(sellerAccountId, sellerBalance + amount);
+        if (fee != 0.0) {
+            tx.addToBalance(schedule->feeAccountId(), fee);
+        }
+        tx.recordExposure(buyerAccountId, sellerAccountId, amount);
+        return true;
+    }
+
+    // Spins, then yields, then sleeps briefly until sequence reaches target.
+    // Returns the sequence reached, or 0 once the order flow stops.
+    uint64_t awaitOrderFlowSequence(const atomic<uint64_t>& sequence, uint64_t target) {
+        for (unsigned idle = 0;; ++idle) {
+            uint64_t available = sequence.load(memory_order_acquire);
+            if (available >= target) return available;
+            if (orderFlowStop.load(memory_order_relaxed)) return 0;
+            if (idle >= 1024) {
+                this_thread::sleep_for(chrono::microseconds(20));
+            } else if (idle >= 64) {
+                this_thread::yield();
+            }
+        }
+    }
+
+    string orderFlowErrorSuffix() {
+        lock_guard<mutex> lock(orderFlowErrorMutex);
+        return orderFlowError.empty() ? string() : ": " + orderFlowError;
+    }
+
+    // Runs handle(first, last) over every batch of at most maxBatch entries that
+    // upstream has released, then releases them downstream. The stage ends when
+    // the order flow stops or handle returns false.
+    template <typename Handler>
+    void runOrderFlowStage(const atomic<uint64_t>& upstream, atomic<uint64_t>& processed, size_t maxBatch,
+                           Handler handle) {
+        uint64_t next = 1;
+        while (true) {
+            uint64_t available = awaitOrderFlowSequence(upstream, next);
+            if (available == 0) return;
+            uint64_t last = min<uint64_t>(available, next + maxBatch - 1);
+            if (!handle(next, last)) return;
+            processed.store(last, memory_order_release);
+            next = last + 1;
+        }
+    }
+
+    void orderFlowJournalStage() {
+        vector<OrderFlowRecord> buffer(orderFlowMask + 1);
+        runOrderFlowStage(orderFlowCursor.value, orderFlowJournaled.value, orderFlowMask + 1,
+                          [this, &buffer](uint64_t first, uint64_t last) {
+            size_t count = 0;
+            for (uint64_t sequence = first; sequence <= last; ++sequence) {
+                buffer[count++] = orderFlowEntries[sequence & orderFlowMask].record;
+            }
+            const char* data = reinterpret_cast<const char*>(buffer.data());
+            size_t size = count * sizeof(OrderFlowRecord);
+            while (size > 0) {
+                ssize_t written = write(orderFlowJournalFd, data, size);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    {
+                        lock_guard<mutex> lock(orderFlowErrorMutex);
+                        orderFlowError = "Journal write failed: " + string(strerror(errno));
+                    }
+                    orderFlowStop.store(true);
+                    return false;
+                }
+                data += written;
+                size -= static_cast<size_t>(written);
+            }
+            return true;
+        });
+    }
+
+    void orderFlowRiskStage() {
+        runOrderFlowStage(orderFlowJournaled.value, orderFlowRiskChecked.value, orderFlowMask + 1,
+                          [this](uint64_t first, uint64_t last) {
+            for (uint64_t sequence = first; sequence <= last; ++sequence) {
+                OrderFlowEntry& entry = orderFlowEntries[sequence & orderFlowMask];
+                const OrderFlowRecord& record = entry.record;
+                if (!(record.amount > 0.0) || record.amount > orderFlowMaxNotional ||
+                    record.buyerAccountId == record.sellerAccountId) {
+                    entry.status = OrderFlowStatus::RejectedByRisk;
+                    orderFlowRejected.fetch_add(1, memory_order_relaxed);
+                }
             }
+            return true;
+        });
+    }
+
+    // Settles each batch of accepted orders in one transaction, retrying the
+    // whole batch on conflict. Orders the buyer cannot pay for fail alone.
+    void orderFlowSettlementStage() {
+        runOrderFlowStage(orderFlowRiskChecked.value, orderFlowSettled.value, kOrderFlowSettlementBatch,
+                          [this](uint64_t first, uint64_t last) {
+            size_t failed = 0;
+            bool committed = false;
+            while (!committed && !orderFlowStop.load(memory_order_relaxed)) {
+                bool frozenOut = false;
+                failed = 0;
+                {
+                    Transaction tx(*this, 10);
+                    auto schedule = atomic_load(&feeSchedule);
+                    for (uint64_t sequence = first; sequence <= last; ++sequence) {
+                        OrderFlowEntry& entry = orderFlowEntries[sequence & orderFlowMask];
+                        if (entry.status == OrderFlowStatus::RejectedByRisk) continue;
+                        const OrderFlowRecord& record = entry.record;
+                        bool settled = false;
+                        try {
+                            settled = applyTrade(tx, schedule.get(), record.buyerAccountId, record.sellerAccountId,
+                                                 record.instrument, record.amount);
+                        } catch (const exception&) {
+                            settled = false;
+                        }
+                        entry.status = settled ? OrderFlowStatus::Settled : OrderFlowStatus::Failed;
+                        failed += !settled;
+                    }
+                    committed = tx.commit();
+                    frozenOut = tx.blockedByCorporateAction();
+                }
+                if (frozenOut) {
+                    waitForCorporateActions();
+                } else if (!committed) {
+                    this_thread::yield();
+                }
+            }
+            if (committed) {
+                orderFlowFailed.fetch_add(failed, memory_order_relaxed);
+            }
+            return committed;
+        });
+    }
 
-            bool success = false;
-            int attempts = 0;
-            const int maxAttempts = 10;
+    void executeQueuedTransaction(const TransactionInfo& transactionInfo) {
+        bool success = false;
+        bool dropped = false;
+        int attempts = 0;
+        const int maxAttempts = 10;
 
-            while (!success && attempts < maxAttempts) {
-                Transaction tx(*this);
+        while (!success && attempts < maxAttempts) {
+            if (transactionInfo.expired(chrono::steady_clock::now())) {
+                dropped = true;
+                break;
+            }
+            bool frozenOut = false;
+            unsigned frozenInstrument = 0;
+            {
+                Transaction tx(*this, transactionInfo.priority);
                 try {
-                    transactionInfo->logic(tx);
+                    transactionInfo.logic(tx);
                     success = tx.commit();
+                    frozenOut = tx.blockedByCorporateAction();
+                    frozenInstrument = tx.blockingInstrument();
                 } catch (const exception& e) {
-                    cout << "Transaction error: " << e.what() << endl;
+                    if (transactionLogging.load(memory_order_relaxed)) {
+                        cout << "Transaction error: " << e.what() << endl;
+                    }
                     success = false;
                 }
+            }
 
-                if (!success) {
-                    this_thread::sleep_for(chrono::milliseconds(1));
-                    attempts++;
+            if (frozenOut) {
+                // Parking does not consume an attempt; if the thaw already ran, retry now.
+                lock_guard<mutex> guard(globalLock);
+                if (frozenInstruments.count(frozenInstrument)) {
+                    parkedTransactions[frozenInstrument].push_back(transactionInfo);
+                    return;
                 }
+            } else if (!success) {
+                this_thread::sleep_for(chrono::milliseconds(1));
+                attempts++;
             }
+        }
 
+        if (dropped) {
+            droppedTransactions++;
+        }
+        if (transactionLogging.load(memory_order_relaxed)) {
             if (success) {
-                cout << "Transaction succeeded: " << transactionInfo->description << endl;
+                cout << "Transaction succeeded: " << transactionInfo.description << endl;
+            } else if (dropped) {
+                cout << "Transaction expired or cancelled: " << transactionInfo.description << endl;
             } else {
-                cout << "Transaction failed after " << maxAttempts << " attempts: " << transactionInfo->description << endl;
+                cout << "Transaction failed after " << maxAttempts << " attempts: " << transactionInfo.description << endl;
             }
-            activeTransactions--;
         }
+        if (transactionInfo.onComplete) {
+            transactionInfo.onComplete(success);
+        }
+        activeTransactions--;
     }
 
 public:
+    size_t expiredTransactionCount() const {
+        return droppedTransactions.load();
+    }
+
     void waitForCompletion() {
         while (activeTransactions.load() > 0) {
             this_thread::sleep_for(chrono::milliseconds(10));
@@ -251,14 +4488,322 @@ public:
         lock_guard<mutex> guard(globalLock);
         auto it = versionedData.find(accountId);
         if (it != versionedData.end() && !it->second.empty()) {
-            cout << "Account " << accountId << " balance: " << it->second.back().second << endl;
+            cout << "Account " << accountId << " balance: " << it->second.newestBalance() << endl;
+        } else if (const ColdLocation* cold = coldLocationLocked(accountId)) {
+            cout << "Account " << accountId << " balance: " << cold->newestBalance << " (evicted)" << endl;
         } else {
             cout << "Account " << accountId << " not found or empty" << endl;
         }
     }
+
+    // Streams accounts in [firstAccountId, lastAccountId] as of a single commit
+    // timestamp. globalLock is held only while a bounded batch of accounts is
+    // formatted; all I/O happens outside it.
+    ReportStats writeReport(int fd, ReportKind kind, unsigned firstAccountId = 0,
+                            unsigned lastAccountId = numeric_limits<unsigned>::max()) {
+        static constexpr size_t kAccountsPerLock = 4096;
+        static constexpr size_t kMaxLine = 64;
+        auto reportStart = chrono::steady_clock::now();
+        ReportBuffers buffers(fd);
+        ReportStats stats{0, 0, 0, 0.0};
+
+        // Evicted accounts are captured up front and merged in ID order; eviction is
+        // suspended for the duration, and an account hydrated meanwhile is reported
+        // from its cold record, which holds the same versions up to asOfTimestamp.
+        ScanGuard scan(activeScans);
+        vector<pair<unsigned, ColdLocation>> coldAccounts;
+        {
+            lock_guard<mutex> guard(globalLock);
+            stats.asOfTimestamp = globalClock.load();
+            for (const auto& entry : coldIndex) {
+                if (entry.first >= firstAccountId && entry.first <= lastAccountId) {
+                    coldAccounts.push_back(entry);
+                }
+            }
+        }
+        sort(coldAccounts.begin(), coldAccounts.end(),
+             [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        auto emitLine = [&](unsigned accountId, unsigned timestamp, double balance) {
+            char* out = buffers.reserve(kMaxLine);
+            if (out == nullptr) return false;
+            out = formatUnsigned(out, accountId);
+            *out++ = ',';
+            if (kind == ReportKind::Histories) {
+                out = formatUnsigned(out, timestamp);
+                *out++ = ',';
+            }
+            out = formatAmount(out, balance);
+            *out++ = '\n';
+            buffers.commit(out);
+            return true;
+        };
+
+        uint64_t nextAccountId = firstAccountId;
+        size_t resumeVersion = 0;
+        vector<AccountRecord::Version> visible;
+        size_t coldNext = 0;
+        bool done = firstAccountId > lastAccountId;
+
+        while (!done) {
+            bool coldHistoryPending = false;
+            {
+                lock_guard<mutex> guard(globalLock);
+                auto it = nextAccountId > lastAccountId ? versionedData.end()
+                                                        : versionedData.lower_bound(static_cast<unsigned>(nextAccountId));
+                bool buffersFull = false;
+                for (size_t batch = 0; batch < kAccountsPerLock; ++batch) {
+                    bool residentLeft = it != versionedData.end() && it->first <= lastAccountId;
+                    bool coldLeft = coldNext < coldAccounts.size();
+                    if (!residentLeft && !coldLeft) {
+                        done = true;
+                        break;
+                    }
+                    if (coldLeft && (!residentLeft || coldAccounts[coldNext].first <= it->first)) {
+                        const auto& cold = coldAccounts[coldNext];
+                        if (kind == ReportKind::Histories) {
+                            coldHistoryPending = true;
+                            break;
+                        }
+                        if (!emitLine(cold.first, cold.second.newestTimestamp, cold.second.newestBalance)) {
+                            break;
+                        }
+                        if (residentLeft && it->first == cold.first) ++it;
+                        nextAccountId = max(nextAccountId, uint64_t{cold.first} + 1);
+                        ++coldNext;
+                        ++stats.accounts;
+                        continue;
+                    }
+
+                    const AccountRecord& account = it->second;
+                    visible.clear();
+                    AccountRecord::Version newest;
+                    if (kind == ReportKind::Histories) {
+                        account.visibleVersions(stats.asOfTimestamp, visible);
+                    } else if (account.versionAt(stats.asOfTimestamp, newest)) {
+                        visible.push_back(newest);
+                    }
+                    if (!visible.empty()) {
+                        for (size_t index = resumeVersion; index < visible.size(); ++index) {
+                            const AccountRecord::Version& version = visible[index];
+                            if (!emitLine(it->first, version.first, version.second)) {
+                                resumeVersion = index;
+                                nextAccountId = it->first;
+                                buffersFull = true;
+                                break;
+                            }
+                        }
+                        if (buffersFull) break;
+                        ++stats.accounts;
+                    }
+                    resumeVersion = 0;
+                    nextAccountId = uint64_t{it->first} + 1;
+                    ++it;
+                }
+            }
+            if (coldHistoryPending) {
+                const auto& cold = coldAccounts[coldNext];
+                visible.clear();
+                readColdRecord(cold.second).visibleVersions(stats.asOfTimestamp, visible);
+                for (const auto& version : visible) {
+                    while (!emitLine(cold.first, version.first, version.second)) {
+                        stats.bytes += buffers.flush();
+                    }
+                }
+                nextAccountId = max(nextAccountId, uint64_t{cold.first} + 1);
+                ++coldNext;
+                ++stats.accounts;
+            } else {
+                stats.bytes += buffers.flush();
+            }
+        }
+
+        stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - reportStart).count();
+        return stats;
+    }
+
+    // Digests every account as of a single commit timestamp. Workers claim runs of
+    // lookup-table slots and walk them without globalLock into private leaf arrays
+    // that are summed at the end. Eviction and GC are suspended meanwhile, as for
+    // reports, so every resident record stays valid.
+    ReconciliationTree reconcile(unsigned leafBits = 16, unsigned numThreads = thread::hardware_concurrency()) {
+        static constexpr size_t kSlotsPerClaim = 16384;
+        if (leafBits < 14 || leafBits > 32) {
+            throw invalid_argument("leafBits must be between 14 and 32");
+        }
+        auto reconcileStart = chrono::steady_clock::now();
+        numThreads = max(1u, numThreads);
+        size_t leafCount = size_t{1} << (32 - leafBits);
+        ReconciliationTree tree{0, leafBits, vector<ReconciliationDigest>(2 * leafCount, ReconciliationDigest{0, 0, 0}), 0.0};
+        auto digest = [leafBits](ReconciliationDigest* leaves, unsigned accountId, double balance) {
+            long long cents = llround(balance * 100.0);
+            uint64_t mixed = (uint64_t{accountId} << 32 | accountId) ^ static_cast<uint64_t>(cents) * 0x9E3779B97F4A7C15ull;
+            mixed = (mixed ^ (mixed >> 30)) * 0xBF58476D1CE4E5B9ull;
+            mixed = (mixed ^ (mixed >> 27)) * 0x94D049BB133111EBull;
+            ReconciliationDigest& leaf = leaves[uint64_t{accountId} >> leafBits];
+            ++leaf.accounts;
+            leaf.balanceCents += cents;
+            leaf.hash += mixed ^ (mixed >> 31);
+        };
+
+        // Evicted accounts are digested from their cold entries; a resident copy
+        // hydrated meanwhile holds the same version at asOfTimestamp and is skipped.
+        ScanGuard scan(activeScans);
+        vector<pair<unsigned, double>> coldBalances;
+        VersionReadGuard viewGuard(versionReaders);
+        AccountLookupTable::View resident = [&] {
+            lock_guard<mutex> guard(globalLock);
+            tree.asOfTimestamp = globalClock.load();
+            coldBalances.reserve(coldIndex.size());
+            for (const auto& entry : coldIndex) {
+                coldBalances.emplace_back(entry.first, entry.second.newestBalance);
+            }
+            return accountLookup.view();
+        }();
+        sort(coldBalances.begin(), coldBalances.end());
+        ReconciliationDigest* leaves = tree.nodes.data() + leafCount;
+        for (const auto& entry : coldBalances) {
+            digest(leaves, entry.first, entry.second);
+        }
+        auto isCold = [&coldBalances](unsigned accountId) {
+            auto it = lower_bound(coldBalances.begin(), coldBalances.end(), accountId,
+                                  [](const pair<unsigned, double>& entry, unsigned id) { return entry.first < id; });
+            return it != coldBalances.end() && it->first == accountId;
+        };
+
+        atomic<size_t> nextSlot{0};
+        vector<vector<ReconciliationDigest>> partialLeaves(numThreads);
+        vector<thread> workers;
+        for (unsigned i = 0; i < numThreads; ++i) {
+            workers.emplace_back([&, i] {
+                vector<ReconciliationDigest>& own = partialLeaves[i];
+                VersionReadGuard readGuard(versionReaders);
+                size_t slot;
+                while ((slot = nextSlot.fetch_add(kSlotsPerClaim)) < resident.capacity()) {
+                    if (own.empty()) own.assign(leafCount, ReconciliationDigest{0, 0, 0});
+                    resident.visit(slot, min(slot + kSlotsPerClaim, resident.capacity()),
+                                   [&](unsigned accountId, const AccountRecord& account) {
+                        AccountRecord::Version version;
+                        if ((coldBalances.empty() || !isCold(accountId)) &&
+                            account.versionAt(tree.asOfTimestamp, version)) {
+                            digest(own.data(), accountId, version.second);
+                        }
+                    });
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        for (const auto& own : partialLeaves) {
+            for (size_t leaf = 0; leaf < own.size(); ++leaf) {
+                leaves[leaf].accounts += own[leaf].accounts;
+                leaves[leaf].balanceCents += own[leaf].balanceCents;
+                leaves[leaf].hash += own[leaf].hash;
+            }
+        }
+        for (size_t node = leafCount - 1; node >= 1; --node) {
+            const ReconciliationDigest& left = tree.nodes[2 * node];
+            const ReconciliationDigest& right = tree.nodes[2 * node + 1];
+            tree.nodes[node] = ReconciliationDigest{left.accounts + right.accounts,
+                                                    left.balanceCents + right.balanceCents, left.hash + right.hash};
+        }
+        tree.seconds = chrono::duration<double>(chrono::steady_clock::now() - reconcileStart).count();
+        return tree;
+    }
+
+    // Returns the [first, last] account ID ranges of the leaves whose digests
+    // differ, in ascending order, descending only into mismatching subtrees.
+    // writeReport over a returned range on both ledgers pinpoints the accounts.
+    static vector<pair<unsigned, unsigned>> diffReconciliation(const ReconciliationTree& a,
+                                                               const ReconciliationTree& b) {
+        if (a.leafBits != b.leafBits || a.nodes.size() != b.nodes.size()) {
+            throw invalid_argument("Reconciliation trees use different leaf sizes");
+        }
+        size_t leafCount = a.nodes.size() / 2;
+        vector<pair<unsigned, unsigned>> ranges;
+        vector<size_t> pending{1};
+        while (!pending.empty()) {
+            size_t node = pending.back();
+            pending.pop_back();
+            if (a.nodes[node] == b.nodes[node]) continue;
+            if (node >= leafCount) {
+                uint64_t first = uint64_t{node - leafCount} << a.leafBits;
+                ranges.emplace_back(static_cast<unsigned>(first),
+                                    static_cast<unsigned>(first + (uint64_t{1} << a.leafBits) - 1));
+            } else {
+                pending.push_back(2 * node + 1);
+                pending.push_back(2 * node);
+            }
+        }
+        return ranges;
+    }
+
+    ReportStats writeReport(const string& path, ReportKind kind, unsigned firstAccountId = 0,
+                            unsigned lastAccountId = numeric_limits<unsigned>::max()) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw runtime_error("Cannot open " + path);
+        }
+        try {
+            ReportStats stats = writeReport(fd, kind, firstAccountId, lastAccountId);
+            close(fd);
+            return stats;
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+    }
 };
 
-int main() {
+// Open-loop transfers between random accounts at rising rates, printed as a
+// throughput-vs-latency table in microseconds.
+static void runOpenLoopBenchmark() {
+    FinancialTransactionSystem fts;
+    const unsigned accounts = 10000;
+    for (unsigned id = 1; id <= accounts; ++id) {
+        fts.createAccount(id, 1e9);
+    }
+    fts.setTransactionLogging(false);
+
+    mt19937 generator(42);
+    uniform_int_distribution<unsigned> account(1, accounts);
+    auto submit = [&](const FinancialTransactionSystem::TransactionOptions& options) {
+        unsigned from = account(generator);
+        unsigned to = from % accounts + 1;
+        return fts.transferFunds(from, to, 1.0, options);
+    };
+
+    // A rate faster than one submission per clock tick must be refused rather than spin.
+    try {
+        fts.runOpenLoop(2e9, chrono::milliseconds(1), submit);
+        cout << "Rate bound check failed: 2e9/s was accepted" << endl;
+    } catch (const invalid_argument& e) {
+        cout << "Rate bound check passed: " << e.what() << endl;
+    }
+
+    auto curve = fts.measureLatencyCurve({1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000},
+                                         chrono::seconds(2), submit);
+
+    cout << "target/s  achieved/s       p50       p99      p999       max" << endl;
+    cout << fixed;
+    for (const auto& point : curve) {
+        const auto& latency = *point.latency;
+        cout << setprecision(0) << setw(8) << point.targetRate << "  " << setw(10) << point.achievedRate
+             << setprecision(1) << "  " << setw(8) << latency.valueAtPercentile(50) / 1e3
+             << "  " << setw(8) << latency.valueAtPercentile(99) / 1e3
+             << "  " << setw(8) << latency.valueAtPercentile(99.9) / 1e3
+             << "  " << setw(8) << latency.max() / 1e3 << endl;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "--open-loop-benchmark") {
+        runOpenLoopBenchmark();
+        return 0;
+    }
+
     FinancialTransactionSystem fts;
 
     fts.createAccount(1, 10000);